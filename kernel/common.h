@@ -2,6 +2,7 @@
 #define RINGBUF_COMMON_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define DEVICE_NAME "ringbufdev"
 
@@ -9,6 +10,58 @@
 #define SET_SIZE_OF_QUEUE _IOW('a', 'a', int *)
 #define PUSH_DATA         _IOW('a', 'b', struct queue_data *)
 #define POP_DATA          _IOR('a', 'c', struct queue_data *)
+#define WAIT_QUEUE        _IOW('a', 'd', int *) /* arg: RINGBUF_WAIT_* */
+#define NOTIFY_QUEUE      _IO('a', 'e')
+#define SET_QUEUE_MODE    _IOW('a', 'f', int *) /* arg: RINGBUF_MODE_* bits */
+#define PUSH_DATA_TIMED   _IOW('a', 'g', struct queue_data_timed *)
+#define POP_DATA_TIMED    _IOR('a', 'h', struct queue_data_timed *)
+#define PUSH_BATCH        _IOW('a', 'i', struct queue_batch *)
+#define POP_BATCH         _IOWR('a', 'j', struct queue_batch *)
+#define SET_SIZE_OF_QUEUE64 _IOW('a', 'k', __u64 *) /* for queues of 2 GB and up */
+#define GET_LATENCY_HIST  _IOWR('a', 'l', struct queue_latency *)
+#define SET_LOWAT         _IOW('a', 'm', struct queue_lowat *)
+
+// WAIT_QUEUE conditions for mmap users
+#define RINGBUF_WAIT_DATA  1 /* at least one byte queued */
+#define RINGBUF_WAIT_SPACE 2 /* at least one byte free */
+
+// SET_QUEUE_MODE bits (default 0: any number of producers and consumers)
+#define RINGBUF_MODE_SPSC  0x1 /* one producer, one consumer: no mutex on push/pop */
+#define RINGBUF_MODE_MSG   0x2 /* keep record boundaries, see below */
+#define RINGBUF_MODE_MIRROR 0x4 /* map the data area twice, see below */
+#define RINGBUF_MODE_LATENCY 0x8 /* measure queue residency, see GET_LATENCY_HIST */
+#define RINGBUF_MODE_POW2  0x10 /* round SET_SIZE_OF_QUEUE(64) up to a power of two */
+#define RINGBUF_MODE_MASK  (RINGBUF_MODE_SPSC | RINGBUF_MODE_MSG | RINGBUF_MODE_MIRROR | \
+                            RINGBUF_MODE_LATENCY | RINGBUF_MODE_POW2)
+
+// RINGBUF_MODE_MSG: each push or write() stores one record and each pop or
+// read() returns exactly one whole record (POP_BATCH: one per entry). A
+// record larger than the pop buffer stays queued and the pop fails with
+// EMSGSIZE; a buffer of the queue size always fits. In the data area a
+// record is a native-endian __u32 payload length followed by the payload,
+// unaligned and wrapping like any other bytes. The bit can only be flipped
+// while the queue is empty (EBUSY otherwise). splice() and sendfile() fail
+// with EINVAL in this mode.
+#define RINGBUF_MSG_HDR_LEN 4
+
+// RINGBUF_MODE_POW2: an allocation mode like RINGBUF_MODE_MIRROR below. The
+// next SET_SIZE_OF_QUEUE(64) rounds the size up to a power of two, so that
+// positions map to offsets with a mask instead of a 64-bit division (any
+// power-of-two size gets this). ringbuf_ctl.size holds the size granted.
+
+// RINGBUF_MODE_MIRROR: an allocation mode, taking effect at the next
+// SET_SIZE_OF_QUEUE(64), whose size must then be a multiple of the page
+// size (EINVAL otherwise). The data pages are mapped twice back to back,
+// in the kernel and in an mmap() of up to two data areas, so any span of
+// up to size bytes from head or tail is contiguous. RINGBUF_CTL_MIRROR in
+// ringbuf_ctl.flags tells whether the current data area is mirrored.
+#define RINGBUF_CTL_MIRROR 0x1
+
+// SET_SIZE_OF_QUEUE(64) keeps the queued data: the new area is allocated
+// first, then every push and pop (SPSC ones included) waits while the
+// queued bytes are copied over, so the stall grows with what is queued.
+// ENOSPC if that does not fit in the new size, EBUSY while the queue is
+// mmap()ed.
 
 // Structure for data exchange between user and kernel
 struct queue_data {
@@ -16,4 +69,97 @@ struct queue_data {
     char *data; // User-space pointer, will be handled with copy_from_user / copy_to_user
 };
 
+// PUSH_DATA_TIMED/POP_DATA_TIMED: queue_data plus a per-call timeout.
+// A call that would still be blocked after timeout_ns fails with ETIMEDOUT
+// (0: fail at once if it would block, < 0: no timeout). A signal ends a
+// timed call with EINTR, as it is not restarted with the same timeout. On
+// an O_NONBLOCK file every push/pop fails with EAGAIN instead of blocking.
+struct queue_data_timed {
+    int length;
+    char *data;
+    __s64 timeout_ns;
+};
+
+// PUSH_BATCH/POP_BATCH: move several messages in one call. The return value
+// is the number of entries processed, in order from entries[0]; at most
+// 1024 per call. PUSH_BATCH pushes each entry whole and stops at the first
+// that does not fit, blocking only while entries[0] does not. POP_BATCH
+// blocks until data is queued, then fills entries until the queue is empty
+// and sets each filled entry's length to the bytes it received; if a length
+// cannot be written back, the entries reported so far are returned (EFAULT
+// if none). PUSH_BATCH writes nothing back: an entry is pushed whole or not
+// at all. Entries past the return value are left untouched.
+struct queue_batch {
+    __u32 nr;                   // number of entries
+    __u32 flags;                // must be 0
+    struct queue_data *entries; // user array of nr entries
+};
+
+// GET_LATENCY_HIST: residency histogram of RINGBUF_MODE_LATENCY. Every
+// push through the kernel is timestamped, and when a pop has consumed its
+// last byte the time in between lands in hist[i] for 2^(i-1) <= ns < 2^i
+// (hist[0]: 0 ns, hist[63]: anything longer). unmarked counts pushes that
+// found all timestamp slots in use and were not measured. Data moved by
+// mmap users is not seen. Set RINGBUF_LAT_RESET in flags to zero the
+// histogram after reading it.
+#define RINGBUF_LAT_BUCKETS 64
+#define RINGBUF_LAT_RESET   0x1
+
+struct queue_latency {
+    __u32 flags;                     // in: RINGBUF_LAT_*
+    __u32 pad;
+    __u64 unmarked;                  // out
+    __u64 hist[RINGBUF_LAT_BUCKETS]; // out
+};
+
+// SET_LOWAT: low watermark of this open file, like SO_RCVLOWAT. Blocking
+// POP_DATA(_TIMED), read() and POP_BATCH on it, and poll() readability,
+// wait until at least `bytes` bytes or, in RINGBUF_MODE_MSG, `msgs` records
+// are queued (0: no such limit; both 0, the default: any data), or until a
+// writer is blocked on the full queue. A bytes value above the queue size
+// means a full queue. Once a pop on the file has taken data, the mark is
+// not applied again until the queue has run empty, so the queued batch is
+// drained one call at a time if need be. With max_wait_ns >= 0, data that
+// stays below the mark is delivered anyway after that long: a pop then
+// takes whatever is queued, and poll() reports it readable once it has been
+// pending that long. A pop counts that time from when poll() first saw the
+// data, so one after a POLLIN does not wait again. This applies to mmap()ed
+// queues too. O_NONBLOCK calls ignore the mark. Records moved through
+// mmap() are not counted by msgs.
+struct queue_lowat {
+    __u64 bytes;
+    __u32 msgs;
+    __u32 pad;          // must be 0
+    __s64 max_wait_ns;  // < 0: wait for the mark indefinitely
+};
+
+// Control page at offset 0 of an mmap() of the device; the data area
+// (size bytes, rounded up to whole pages) follows from the next page.
+// head and tail are free-running byte counters: the consumer owns head,
+// the producer owns tail, tail - head bytes are queued and position pos
+// lives at data[pos % size]. Publish a position with a release store and
+// read the other side's with an acquire load. After moving a position,
+// issue a full barrier and call NOTIFY_QUEUE if the matching *_waiters
+// flag is set.
+//
+// The read-only fields, head and tail sit RINGBUF_CTL_LINE bytes apart so
+// that a producer and a consumer on different CPUs do not bounce one cache
+// line between them. Each position shares its line only with the waiters
+// flag the same side checks after moving it.
+#define RINGBUF_CTL_LINE 128 // covers adjacent-line prefetch as well
+
+struct ringbuf_ctl {
+    __u64 size;          // data area capacity in bytes (read-only)
+    __u32 flags;         // RINGBUF_CTL_* (read-only)
+    __u8 pad0[RINGBUF_CTL_LINE - 12];
+    // consumer line
+    __u64 head;          // consumer position
+    __u32 space_waiters; // set by the kernel while a writer sleeps
+    __u8 pad1[RINGBUF_CTL_LINE - 12];
+    // producer line
+    __u64 tail;          // producer position
+    __u32 data_waiters;  // set by the kernel while a reader sleeps
+    __u8 pad2[RINGBUF_CTL_LINE - 12];
+};
+
 #endif // RINGBUF_COMMON_H
@@ -1,6 +1,20 @@
 /*
  * ringbuf.c - dynamic circular queue char device with blocking POP via IOCTL
  *
+ * read() and write() stream bytes through the same queue: read() blocks
+ * like POP_DATA, write() blocks until some space is free and stores as much
+ * as fits. PUSH_DATA blocks until the whole message fits. splice() and
+ * sendfile() go through the same two paths, copying straight between the
+ * ring and pipe pages (byte streams only).
+ *
+ * In RINGBUF_MODE_MSG the queue keeps record boundaries instead: every
+ * push or write() stores one length-prefixed record and every pop or
+ * read() returns exactly one whole record.
+ *
+ * The ring can also be mmap()ed (ctl page + data area) so that producers and
+ * consumers exchange data with plain loads/stores, entering the kernel only
+ * to sleep (WAIT_QUEUE) or to wake the other side (NOTIFY_QUEUE).
+ *
  * Place this file in ringbuf-dev/kernel/
  */
 
@@ -9,263 +23,1019 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/pagemap.h>
 #include <linux/slab.h>
+#include <linux/cache.h>
+#include <linux/string.h>
 #include <linux/device.h>
 #include <linux/wait.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/srcu.h>
 #include <linux/sched.h> /* for TASK_INTERRUPTIBLE */
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
 #include "common.h"
 
+#define CREATE_TRACE_POINTS
+#include "ringbuf_trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Your Name");
 MODULE_DESCRIPTION("Dynamic circular queue char device (ringbufdev)");
 
-/* Circular queue structure */
-struct ringbuf {
-    char *buf;            /* kmalloc'd buffer */
-    size_t size;          /* capacity */
-    size_t head;          /* read index */
-    size_t tail;          /* write index */
-    size_t count;         /* bytes stored */
-    wait_queue_head_t rq; /* readers wait queue */
-    struct mutex lock;    /* protect structure */
+/*
+ * Helper: allocate a ring of sz bytes. Plain rings are vmalloc_user()
+ * memory: zeroed and page-granular, so it can be mapped to users. With
+ * mirror (RINGBUF_MODE_MIRROR, sz a multiple of PAGE_SIZE) the same pages
+ * are vmap()ed twice back to back, so buf[off .. off + sz) is contiguous
+ * for any off < sz and no copy has to be split at the wrap. *pagesp is set
+ * to the page array of a mirrored ring, NULL otherwise.
+ */
+static char *ringbuf_alloc(size_t sz, bool mirror, struct page ***pagesp)
+{
+    unsigned long i, nr = sz >> PAGE_SHIFT;
+    struct page **pages;
+    char *buf;
+
+    *pagesp = NULL;
+    if (!mirror)
+        return vmalloc_user(sz);
+
+    pages = kvmalloc_array(2 * nr, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+        return NULL;
+    for (i = 0; i < nr; ++i) {
+        pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!pages[i])
+            goto err;
+        pages[nr + i] = pages[i];
+    }
+
+    buf = vmap(pages, 2 * nr, VM_MAP, PAGE_KERNEL);
+    if (!buf)
+        goto err;
+    *pagesp = pages;
+    return buf;
+
+err:
+    while (i--)
+        __free_page(pages[i]);
+    kvfree(pages);
+    return NULL;
+}
+
+/* Helper: release a ring from ringbuf_alloc() */
+static void ringbuf_free_buf(char *buf, struct page **pages, size_t sz)
+{
+    unsigned long i;
+
+    if (!pages) {
+        vfree(buf);
+        return;
+    }
+
+    vunmap(buf);
+    for (i = 0; i < sz >> PAGE_SHIFT; ++i)
+        __free_page(pages[i]);
+    kvfree(pages);
+}
+
+/* the queue and its data path, shared with the userspace build */
+#include "ringbuf_core.h"
+
+/* independent queues, one per minor: /dev/ringbufdev0..nr_queues-1 */
+static unsigned int nr_queues = 1;
+module_param(nr_queues, uint, 0444);
+MODULE_PARM_DESC(nr_queues, "number of queue devices to create (default 1)");
+
+#define RINGBUF_MAX_QUEUES 256
+
+/* entries handled per PUSH_BATCH/POP_BATCH call */
+#define RINGBUF_BATCH_MAX 1024
+
+static struct ringbuf *rbs;
+
+/*
+ * Per open file: the queue and its low watermark, and a scratch descriptor
+ * array for PUSH_BATCH/POP_BATCH that grows to the largest batch seen and
+ * is kept until release, so steady-state batch calls do not allocate
+ */
+struct ringbuf_file {
+    struct ringbuf_reader rd;    /* rd.rb is the queue */
+    struct mutex scratch_lock;   /* held while a batch uses scratch */
+    struct queue_data *scratch;
+    unsigned int scratch_nr;     /* entries scratch holds */
 };
 
-static struct ringbuf rb;
+static inline struct ringbuf *ringbuf_of(struct file *file)
+{
+    return ((struct ringbuf_file *)file->private_data)->rd.rb;
+}
 
 /* char device bookkeeping */
 static dev_t devnum;
 static struct cdev rb_cdev;
 static struct class *rb_class;
 
-/* Helper: init ring buffer (caller should ensure appropriate locking/state) */
-static int ringbuf_init(size_t sz)
+/*
+ * One PUSH_BATCH attempt: push entries in order within a single
+ * ringbuf_enter() section, each all or nothing, stopping at the first that
+ * does not fit or fails. Returns the number pushed, or the first entry's
+ * error if none was.
+ */
+static ssize_t ringbuf_push_batch_once(struct ringbuf *rb, struct queue_data *ents,
+                                       unsigned int nr)
 {
-    if (sz == 0)
+    struct iovec iov;
+    struct iov_iter iter;
+    unsigned int i;
+    ssize_t ret = 0;
+    int idx;
+
+    idx = ringbuf_enter(rb);
+    for (i = 0; i < nr; ++i) {
+        if (ents[i].length <= 0) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = import_single_range(WRITE, (void __user *)ents[i].data, ents[i].length,
+                                  &iov, &iter);
+        if (!ret)
+            ret = ringbuf_push_iter(rb, &iter, false);
+        if (ret < 0)
+            break;
+    }
+    ringbuf_exit(rb, idx);
+    return i ? (ssize_t)i : ret;
+}
+
+/*
+ * One POP_BATCH attempt: fill entries in order within a single
+ * ringbuf_enter() section until the queue runs dry, storing the bytes
+ * popped into each entry's length. Returns the number of entries filled,
+ * 0 if the queue was empty, or the first entry's error.
+ */
+static ssize_t ringbuf_pop_batch_once(struct ringbuf *rb, struct queue_data *ents,
+                                      unsigned int nr)
+{
+    struct iovec iov;
+    struct iov_iter iter;
+    unsigned int i;
+    ssize_t ret = 0;
+    int idx;
+
+    idx = ringbuf_enter(rb);
+    for (i = 0; i < nr; ++i) {
+        if (ents[i].length <= 0) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = import_single_range(READ, (void __user *)ents[i].data, ents[i].length,
+                                  &iov, &iter);
+        if (!ret)
+            ret = ringbuf_pop_iter(rb, &iter);
+        if (ret <= 0)
+            break;
+        ents[i].length = (int)ret;
+    }
+    ringbuf_exit(rb, idx);
+    return i ? (ssize_t)i : ret;
+}
+
+/* deadline for a call on file with an optional timeout (< 0: none) */
+static ktime_t ringbuf_deadline(struct file *file, s64 timeout_ns)
+{
+    if (file->f_flags & O_NONBLOCK)
+        return RINGBUF_DEADLINE_NOWAIT;
+    return ringbuf_deadline_after(timeout_ns);
+}
+
+/*
+ * A relative timeout would start over if a call interrupted by a signal
+ * were restarted, so one with a deadline fails with -EINTR instead
+ */
+static long ringbuf_restart(long ret, ktime_t deadline)
+{
+    if (ret == -ERESTARTSYS && deadline != RINGBUF_DEADLINE_NONE)
+        return -EINTR;
+    return ret;
+}
+
+/*
+ * PUSH_BATCH: push as many entries as fit under one lock acquisition,
+ * blocking (up to deadline) only while not even the first one fits.
+ */
+static ssize_t ringbuf_push_batch(struct ringbuf *rb, struct queue_data *ents,
+                                  unsigned int nr, ktime_t deadline)
+{
+    size_t need;
+    ssize_t ret;
+
+    for (;;) {
+        need = ringbuf_need(rb, ents[0].length, false);
+        if (need > READ_ONCE(rb->size))
+            return -EMSGSIZE; /* can never fit */
+
+        ret = ringbuf_push_batch_once(rb, ents, nr);
+        if (ret == -ENOSPC) {
+            ret = ringbuf_wait_space(rb, need, deadline);
+            if (ret)
+                return ret;
+            continue;
+        }
+        if (ret != -EFAULT)
+            break;
+
+        /* first source not resident: fault it in unlocked and retry */
+        if (fault_in_readable((const char __user *)ents[0].data, ents[0].length))
+            return -EFAULT;
+    }
+
+    /* one record per entry in RINGBUF_MODE_MSG, see ringbuf_wake_readers() */
+    if (ret > 0)
+        ringbuf_wake_readers(rb, ringbuf_msg_mode(rb) ? (int)ret : 1);
+    return ret;
+}
+
+/*
+ * POP_BATCH: wait (up to deadline) until data is queued, reaching the low
+ * watermark lw if any, then fill as many entries as the queued data covers
+ * under one lock acquisition.
+ */
+static ssize_t ringbuf_pop_batch(struct ringbuf *rb, struct queue_data *ents,
+                                 unsigned int nr, ktime_t deadline,
+                                 const struct ringbuf_lowat *lw)
+{
+    bool slept = false;
+    ktime_t until;
+    ssize_t ret;
+
+    lw = ringbuf_lowat_start(lw, deadline, &until);
+    for (;;) {
+        if (ringbuf_readable(rb, lw)) {
+            ret = ringbuf_pop_batch_once(rb, ents, nr);
+            if (ret == -EFAULT) {
+                /* first destination not resident: fault it in, retry */
+                if (fault_in_writeable((char __user *)ents[0].data, ents[0].length))
+                    break;
+                continue;
+            }
+            if (ret != 0)
+                break;
+        }
+
+        ret = ringbuf_wait_data(rb, lw, until);
+        slept = true;
+        if (ret == -ETIMEDOUT && until != deadline) {
+            lw = NULL; /* see ringbuf_pop() */
+            until = deadline;
+            continue;
+        }
+        if (ret)
+            break;
+    }
+
+    if (ret > 0)
+        ringbuf_wake_writers(rb);
+    if (slept)
+        ringbuf_pass_wake(rb);
+    return ret;
+}
+
+/*
+ * Descriptor array for an nr-entry batch: the file's scratch array, grown
+ * if needed, or a temporary one when another thread sharing the file is
+ * using it. *scratch tells ringbuf_put_ents() which. A batch keeps scratch
+ * while it blocks, so only one batch caller per file at a time avoids the
+ * allocation.
+ */
+static struct queue_data *ringbuf_get_ents(struct ringbuf_file *rf, unsigned int nr,
+                                           bool *scratch)
+{
+    struct queue_data *ents;
+    unsigned int want;
+
+    *scratch = mutex_trylock(&rf->scratch_lock);
+    if (!*scratch)
+        return kvmalloc_array(nr, sizeof(*ents), GFP_KERNEL);
+
+    if (nr > rf->scratch_nr) {
+        want = min_t(unsigned int, roundup_pow_of_two(nr), RINGBUF_BATCH_MAX);
+        ents = kvmalloc_array(want, sizeof(*ents), GFP_KERNEL);
+        if (!ents) {
+            mutex_unlock(&rf->scratch_lock);
+            return NULL;
+        }
+        kvfree(rf->scratch);
+        rf->scratch = ents;
+        rf->scratch_nr = want;
+    }
+    return rf->scratch;
+}
+
+static void ringbuf_put_ents(struct ringbuf_file *rf, struct queue_data *ents, bool scratch)
+{
+    if (scratch)
+        mutex_unlock(&rf->scratch_lock);
+    else
+        kvfree(ents);
+}
+
+/*
+ * PUSH_BATCH/POP_BATCH ioctl: copy the descriptor array in, run the batch
+ * and, for POP_BATCH, copy each filled entry's length back. Batches larger
+ * than RINGBUF_BATCH_MAX are cut short; the return value tells the caller
+ * how many entries were processed. PUSH_BATCH stores each entry whole, so
+ * it has no per-entry result to copy back.
+ */
+static long ringbuf_ioctl_batch(struct ringbuf *rb, struct file *file, unsigned int cmd,
+                                unsigned long arg)
+{
+    struct ringbuf_file *rf = file->private_data;
+    struct queue_data __user *uents;
+    struct ringbuf_lowat lw;
+    struct queue_batch qb;
+    struct queue_data *ents;
+    unsigned int nr, i;
+    bool scratch;
+    ssize_t ret;
+
+    if (copy_from_user(&qb, (struct queue_batch __user *)arg, sizeof(qb)))
+        return -EFAULT;
+    if (qb.flags || !qb.nr)
         return -EINVAL;
 
-    rb.buf = kmalloc(sz, GFP_KERNEL);
-    if (!rb.buf)
+    uents = (struct queue_data __user *)qb.entries;
+    nr = min_t(unsigned int, qb.nr, RINGBUF_BATCH_MAX);
+    ents = ringbuf_get_ents(rf, nr, &scratch);
+    if (!ents)
         return -ENOMEM;
+    if (copy_from_user(ents, uents, nr * sizeof(*ents))) {
+        ret = -EFAULT;
+        goto out;
+    }
+    if (ents[0].length <= 0) {
+        ret = -EINVAL;
+        goto out;
+    }
 
-    rb.size = sz;
-    rb.head = rb.tail = rb.count = 0;
-    init_waitqueue_head(&rb.rq);
-    mutex_init(&rb.lock);
-    pr_info("ringbuf: allocated buffer of %zu bytes\n", sz);
-    return 0;
+    if (cmd == PUSH_BATCH) {
+        ret = ringbuf_push_batch(rb, ents, nr, ringbuf_deadline(file, -1));
+        goto out;
+    }
+
+    ret = ringbuf_pop_batch(rb, ents, nr, ringbuf_deadline(file, -1),
+                            ringbuf_get_lowat(&rf->rd, &lw));
+    if (ret > 0)
+        ringbuf_lowat_popped(&rf->rd);
+    for (i = 0; ret > 0 && i < ret; ++i) {
+        /* the data is consumed: report the entries already filled in */
+        if (put_user(ents[i].length, &uents[i].length)) {
+            ret = i ? (ssize_t)i : -EFAULT;
+            break;
+        }
+    }
+out:
+    ringbuf_put_ents(rf, ents, scratch);
+    return ret;
 }
 
-/* Helper: free ring buffer */
-static void ringbuf_free(void)
+/* GET_LATENCY_HIST: sum the per-CPU histograms, then reset them if asked */
+static int ringbuf_get_latency(struct ringbuf *rb, struct queue_latency __user *arg)
 {
-    if (rb.buf) {
-        kfree(rb.buf);
-        rb.buf = NULL;
+    struct queue_latency ql;
+    struct ringbuf_stats *st;
+    int cpu, i;
+
+    memset(&ql, 0, sizeof(ql));
+    if (get_user(ql.flags, &arg->flags))
+        return -EFAULT;
+    if (ql.flags & ~RINGBUF_LAT_RESET)
+        return -EINVAL;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(rb->stats, cpu);
+        for (i = 0; i < RINGBUF_LAT_BUCKETS; ++i)
+            ql.hist[i] += READ_ONCE(st->lat_hist[i]);
+        ql.unmarked += READ_ONCE(st->lat_unmarked);
+    }
+    if (copy_to_user(arg, &ql, sizeof(ql)))
+        return -EFAULT;
+
+    if (ql.flags & RINGBUF_LAT_RESET) {
+        /* a pop racing on another CPU may keep its increment; that is fine */
+        for_each_possible_cpu(cpu) {
+            st = per_cpu_ptr(rb->stats, cpu);
+            for (i = 0; i < RINGBUF_LAT_BUCKETS; ++i)
+                WRITE_ONCE(st->lat_hist[i], 0);
+            WRITE_ONCE(st->lat_unmarked, 0);
+        }
     }
-    rb.size = rb.head = rb.tail = rb.count = 0;
+    return 0;
 }
 
-/* push bytes into ring (caller must hold mutex) */
-static ssize_t ringbuf_push_locked(const char *kdata, size_t len)
+/* SET_LOWAT: copy in and check the mark, see ringbuf_reader_set_lowat() */
+static int ringbuf_set_lowat(struct ringbuf_file *rf, struct queue_lowat __user *arg)
 {
-    size_t i;
+    struct queue_lowat ql;
 
-    if (len > rb.size - rb.count)
-        return -ENOSPC; /* no enough space */
+    if (copy_from_user(&ql, arg, sizeof(ql)))
+        return -EFAULT;
+    if (ql.pad)
+        return -EINVAL;
 
-    for (i = 0; i < len; ++i) {
-        rb.buf[rb.tail] = kdata[i];
-        rb.tail = (rb.tail + 1) % rb.size;
-    }
-    rb.count += len;
-    return (ssize_t)len;
+    ringbuf_reader_set_lowat(&rf->rd, (size_t)min_t(u64, ql.bytes, RINGBUF_MAX_SIZE),
+                             ql.msgs, ql.max_wait_ns);
+    return 0;
+}
+
+/*
+ * WAIT_QUEUE conditions. wait_event re-evaluates these after queueing the
+ * task, so the waiter flag is always raised before the indices are read;
+ * the full barrier orders the two. An mmap user that stores head/tail,
+ * issues a full barrier and then reads the flag therefore either sees the
+ * flag and calls NOTIFY_QUEUE, or its update is seen here.
+ */
+static bool ringbuf_data_ready(struct ringbuf *rb)
+{
+    WRITE_ONCE(rb->ctl->data_waiters, 1);
+    smp_mb();
+    return ringbuf_count(rb) > 0;
 }
 
-/* pop up to len bytes from ring into out (caller must hold mutex) */
-static ssize_t ringbuf_pop_locked(char *out, size_t len)
+static bool ringbuf_space_ready(struct ringbuf *rb)
 {
-    size_t i;
-    size_t tocopy = len;
+    WRITE_ONCE(rb->ctl->space_waiters, 1);
+    smp_mb();
+    return ringbuf_writable(rb, ringbuf_need(rb, 1, true));
+}
 
-    if (tocopy > rb.count)
-        tocopy = rb.count;
+/*
+ * copy in a PUSH/POP request: struct queue_data, or struct queue_data_timed
+ * for the *_TIMED variants, which shares its leading fields
+ */
+static int ringbuf_get_request(struct file *file, unsigned int cmd, unsigned long arg,
+                               struct queue_data *ud, ktime_t *deadline)
+{
+    struct queue_data_timed tq;
 
-    for (i = 0; i < tocopy; ++i) {
-        out[i] = rb.buf[rb.head];
-        rb.head = (rb.head + 1) % rb.size;
+    if (cmd == PUSH_DATA_TIMED || cmd == POP_DATA_TIMED) {
+        if (copy_from_user(&tq, (struct queue_data_timed __user *)arg, sizeof(tq)))
+            return -EFAULT;
+        ud->length = tq.length;
+        ud->data = tq.data;
+        *deadline = ringbuf_deadline(file, tq.timeout_ns);
+    } else {
+        if (copy_from_user(ud, (struct queue_data __user *)arg, sizeof(*ud)))
+            return -EFAULT;
+        *deadline = ringbuf_deadline(file, -1);
     }
-    rb.count -= tocopy;
-    return (ssize_t)tocopy;
+
+    if (ud->length <= 0)
+        return -EINVAL;
+    return 0;
 }
 
-/* IOCTL handler implementing SET_SIZE_OF_QUEUE, PUSH_DATA, POP_DATA */
-static long ringbuf_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+/*
+ * IOCTL handler implementing SET_SIZE_OF_QUEUE(64), SET_QUEUE_MODE, PUSH_DATA,
+ * POP_DATA (and their *_TIMED variants), PUSH_BATCH, POP_BATCH,
+ * GET_LATENCY_HIST, SET_LOWAT and the WAIT_QUEUE/NOTIFY_QUEUE pair used by
+ * mmap users
+ */
+static long ringbuf_do_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
+    struct ringbuf_file *rf = file->private_data;
+    struct ringbuf *rb = rf->rd.rb;
     int ks; /* size from user */
+    u64 sz; /* SET_SIZE_OF_QUEUE64 size */
     struct queue_data ud; /* user struct copy */
-    char *kbuf = NULL;
+    char *nbuf;
+    struct page **npages;
+    struct iovec iov;
+    struct iov_iter iter; /* ud.data as an iterator for push/pop */
+    ktime_t deadline;
     ssize_t ret = 0;
+    int mode;
 
     switch (cmd) {
     case SET_SIZE_OF_QUEUE:
-        if (copy_from_user(&ks, (int __user *)arg, sizeof(int)))
-            return -EFAULT;
-        if (ks <= 0)
+    case SET_SIZE_OF_QUEUE64:
+        if (cmd == SET_SIZE_OF_QUEUE64) {
+            if (copy_from_user(&sz, (__u64 __user *)arg, sizeof(sz)))
+                return -EFAULT;
+        } else {
+            if (copy_from_user(&ks, (int __user *)arg, sizeof(int)))
+                return -EFAULT;
+            sz = ks > 0 ? ks : 0;
+        }
+        mode = READ_ONCE(rb->mode);
+        sz = ringbuf_round_size(mode, sz);
+        if (!sz || sz > RINGBUF_MAX_SIZE)
             return -EINVAL;
-
-        /* reinitialize buffer */
-        mutex_lock(&rb.lock);
-        ringbuf_free();
-        ret = ringbuf_init((size_t)ks);
-        mutex_unlock(&rb.lock);
-        return ret;
-
-    case PUSH_DATA:
-        /* get struct with length + user pointer */
-        if (copy_from_user(&ud, (struct queue_data __user *)arg, sizeof(ud)))
-            return -EFAULT;
-        if (ud.length <= 0)
+        if (mode & RINGBUF_MODE_MIRROR && !PAGE_ALIGNED(sz))
             return -EINVAL;
 
-        kbuf = kmalloc(ud.length, GFP_KERNEL);
-        if (!kbuf)
+        /* allocate before taking the mutex: push/pop only stall for the copy */
+        nbuf = ringbuf_alloc((size_t)sz, mode & RINGBUF_MODE_MIRROR, &npages);
+        if (!nbuf)
             return -ENOMEM;
 
-        if (copy_from_user(kbuf, ud.data, ud.length)) {
-            kfree(kbuf);
-            return -EFAULT;
+        mutex_lock(&rb->lock);
+        if (atomic_read(&rb->mmap_count)) {
+            /* users still address the old buffer through a mapping */
+            ret = -EBUSY;
+        } else {
+            mode = ringbuf_quiesce(rb);
+            ret = ringbuf_resize(rb, nbuf, npages, (size_t)sz);
+            ringbuf_resume(rb, mode);
+        }
+        mutex_unlock(&rb->lock);
+        if (ret) {
+            ringbuf_free_buf(nbuf, npages, (size_t)sz);
+            return ret;
         }
 
-        mutex_lock(&rb.lock);
-        ret = ringbuf_push_locked(kbuf, (size_t)ud.length);
-        mutex_unlock(&rb.lock);
+        /* every writer and poller re-checks its need against the new size */
+        WRITE_ONCE(rb->wr_need, SIZE_MAX);
+        wake_up_interruptible_poll(&rb->wq, EPOLLOUT | EPOLLWRNORM);
+        ringbuf_stat_add(rb, wakeups, 1);
+        return 0;
 
-        kfree(kbuf);
+    case SET_QUEUE_MODE:
+        if (copy_from_user(&ks, (int __user *)arg, sizeof(int)))
+            return -EFAULT;
+        if (ks & ~RINGBUF_MODE_MASK)
+            return -EINVAL;
 
-        if (ret > 0) {
-            /* wake any blocked POP callers */
-            wake_up_interruptible(&rb.rq);
+        /* no lockless caller may still be running under the old mode */
+        mutex_lock(&rb->lock);
+        mode = ringbuf_quiesce(rb);
+        ret = ringbuf_set_mode(rb, mode, ks);
+        ringbuf_resume(rb, ret ? mode : ks);
+        mutex_unlock(&rb->lock);
+        return ret;
+
+    case GET_LATENCY_HIST:
+        return ringbuf_get_latency(rb, (struct queue_latency __user *)arg);
+
+    case SET_LOWAT:
+        return ringbuf_set_lowat(rf, (struct queue_lowat __user *)arg);
+
+    case PUSH_DATA:
+    case PUSH_DATA_TIMED:
+        /* get struct with length + user pointer (+ timeout) */
+        ret = ringbuf_get_request(file, cmd, arg, &ud, &deadline);
+        if (ret)
             return ret;
-        }
-        return ret; /* may be -ENOSPC */
+        ret = import_single_range(WRITE, ud.data, ud.length, &iov, &iter);
+        if (ret)
+            return ret;
+
+        /* copy straight from the caller into the ring, all or nothing */
+        return ringbuf_restart(ringbuf_push(rb, &iter, false, deadline), deadline);
 
     case POP_DATA:
+    case POP_DATA_TIMED:
         /* copy the user struct to get pointer + requested length */
-        if (copy_from_user(&ud, (struct queue_data __user *)arg, sizeof(ud)))
-            return -EFAULT;
-        if (ud.length <= 0)
-            return -EINVAL;
+        ret = ringbuf_get_request(file, cmd, arg, &ud, &deadline);
+        if (ret)
+            return ret;
+        ret = import_single_range(READ, ud.data, ud.length, &iov, &iter);
+        if (ret)
+            return ret;
 
-        kbuf = kmalloc(ud.length, GFP_KERNEL);
-        if (!kbuf)
-            return -ENOMEM;
+        /* Block until data available (or deadline, or signal interrupts) */
+        ret = ringbuf_reader_pop(&rf->rd, &iter, deadline);
+        if (ret < 0)
+            return ringbuf_restart(ret, deadline);
 
-        /* Block until data available (or signal interrupts) */
-        for (;;) {
-            mutex_lock(&rb.lock);
-            if (rb.count > 0) {
-                /* data available, pop now */
-                ret = ringbuf_pop_locked(kbuf, (size_t)ud.length);
-                mutex_unlock(&rb.lock);
-                break;
-            }
-            mutex_unlock(&rb.lock);
+        /* update length field in user struct to actual bytes copied */
+        if (put_user((int)ret, &((struct queue_data __user *)arg)->length))
+            return -EFAULT;
+        return ret;
 
-            /* Wait until someone pushes data or signal */
-            if (wait_event_interruptible(rb.rq, rb.count > 0)) {
-                /* interrupted by signal */
-                kfree(kbuf);
-                return -ERESTARTSYS;
-            }
-            /* loop to try again */
-        }
+    case PUSH_BATCH:
+    case POP_BATCH:
+        return ringbuf_ioctl_batch(rb, file, cmd, arg);
 
-        /* copy popped bytes back to user buffer */
-        if (ret > 0) {
-            if (copy_to_user(ud.data, kbuf, ret)) {
-                kfree(kbuf);
-                return -EFAULT;
-            }
-            /* update length field in user struct to actual bytes copied */
-            if (put_user((int)ret, &((struct queue_data __user *)arg)->length)) {
-                kfree(kbuf);
-                return -EFAULT;
-            }
-        }
+    case WAIT_QUEUE:
+        /* sleep on behalf of an mmap user until its side can make progress */
+        if (copy_from_user(&ks, (int __user *)arg, sizeof(int)))
+            return -EFAULT;
 
-        kfree(kbuf);
+        switch (ks) {
+        case RINGBUF_WAIT_DATA:
+            ret = wait_event_interruptible(rb->rq, ringbuf_data_ready(rb));
+            break;
+        case RINGBUF_WAIT_SPACE:
+            ret = wait_event_interruptible(rb->wq, ringbuf_space_ready(rb));
+            break;
+        default:
+            return -EINVAL;
+        }
         return ret;
 
+    case NOTIFY_QUEUE:
+        /*
+         * an mmap user moved head or tail: clear the flags, then wake.
+         * Readers sleep exclusively and may decline the wake (low
+         * watermark), so keep data_waiters up for those left asleep;
+         * likewise space_waiters for writers still short of room.
+         */
+        WRITE_ONCE(rb->ctl->data_waiters, 0);
+        WRITE_ONCE(rb->ctl->space_waiters, 0);
+        wake_up_interruptible(&rb->rq);
+        wake_up_interruptible(&rb->wq);
+        ringbuf_stat_add(rb, wakeups, 2);
+        if (wq_has_sleeper(&rb->rq))
+            WRITE_ONCE(rb->ctl->data_waiters, 1);
+        if (wq_has_sleeper(&rb->wq))
+            WRITE_ONCE(rb->ctl->space_waiters, 1);
+        return 0;
+
     default:
         return -EINVAL;
     }
 }
 
-/* file ops: open/release minimal */
+/* unlocked_ioctl: every command is traced with its result */
+static long ringbuf_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct ringbuf *rb = ringbuf_of(file);
+    long ret;
+
+    ret = ringbuf_do_ioctl(file, cmd, arg);
+    trace_ringbuf_ioctl(rb->id, cmd, ret);
+    return ret;
+}
+
+/* read(): stream bytes out, blocking like POP_DATA until some are queued */
+static ssize_t ringbuf_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct ringbuf_file *rf = iocb->ki_filp->private_data;
+    ktime_t deadline = ringbuf_deadline(iocb->ki_filp, -1);
+
+    if (!iov_iter_count(to))
+        return 0;
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        deadline = RINGBUF_DEADLINE_NOWAIT;
+    return ringbuf_reader_pop(&rf->rd, to, deadline);
+}
+
+/* write(): stream bytes in, blocking while the queue is full */
+static ssize_t ringbuf_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct ringbuf *rb = ringbuf_of(iocb->ki_filp);
+    ktime_t deadline = ringbuf_deadline(iocb->ki_filp, -1);
+
+    if (!iov_iter_count(from))
+        return 0;
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        deadline = RINGBUF_DEADLINE_NOWAIT;
+    return ringbuf_push(rb, from, true, deadline);
+}
+
+/*
+ * splice()/sendfile(): byte streams only. A pipe takes no more than its
+ * free pages, so a record could not always be popped whole, and pipe
+ * buffers do not keep record boundaries for the way in.
+ */
+static ssize_t ringbuf_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+                                   size_t len, unsigned int flags)
+{
+    if (ringbuf_msg_mode(ringbuf_of(in)))
+        return -EINVAL;
+    return generic_file_splice_read(in, ppos, pipe, len, flags);
+}
+
+static ssize_t ringbuf_splice_write(struct pipe_inode_info *pipe, struct file *out,
+                                    loff_t *ppos, size_t len, unsigned int flags)
+{
+    if (ringbuf_msg_mode(ringbuf_of(out)))
+        return -EINVAL;
+    return iter_file_splice_write(pipe, out, ppos, len, flags);
+}
+
+/*
+ * poll/epoll: readable while any byte is queued (or the file's low
+ * watermark is met), writable while any byte is free, see
+ * ringbuf_poll_mask(). Pushes wake rq and pops wake wq, so both are polled.
+ */
+static __poll_t ringbuf_poll(struct file *file, poll_table *wait)
+{
+    struct ringbuf_file *rf = file->private_data;
+    struct ringbuf *rb = rf->rd.rb;
+
+    poll_wait(file, &rb->rq, wait);
+    poll_wait(file, &rb->wq, wait);
+    return ringbuf_poll_mask(&rf->rd, poll_requested_events(wait), !poll_does_not_wait(wait));
+}
+
+/* file ops: open binds the file to its queue, release frees the per-file state */
 static int ringbuf_open(struct inode *inode, struct file *file)
 {
-    return 0;
+    struct ringbuf_file *rf;
+
+    rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+    if (!rf)
+        return -ENOMEM;
+    ringbuf_reader_init(&rf->rd, &rbs[iminor(inode) - MINOR(devnum)]);
+    mutex_init(&rf->scratch_lock);
+
+    file->private_data = rf;
+    file->f_mode |= FMODE_NOWAIT; /* read/write honour IOCB_NOWAIT */
+    return stream_open(inode, file); /* a queue has no file position */
 }
 static int ringbuf_release(struct inode *inode, struct file *file)
 {
+    struct ringbuf_file *rf = file->private_data;
+
+    ringbuf_reader_release(&rf->rd);
+    kvfree(rf->scratch);
+    mutex_destroy(&rf->scratch_lock);
+    kfree(rf);
     return 0;
 }
 
+/* mapping lifetime tracking: the buffer cannot be resized while mapped */
+static void ringbuf_vm_open(struct vm_area_struct *vma)
+{
+    struct ringbuf *rb = vma->vm_private_data;
+
+    atomic_inc(&rb->mmap_count);
+}
+
+static void ringbuf_vm_close(struct vm_area_struct *vma)
+{
+    struct ringbuf *rb = vma->vm_private_data;
+
+    atomic_dec(&rb->mmap_count);
+}
+
+static const struct vm_operations_struct ringbuf_vm_ops = {
+    .open = ringbuf_vm_open,
+    .close = ringbuf_vm_close,
+};
+
+/*
+ * mmap: page 0 is the ringbuf_ctl page, the data area follows from page 1.
+ * The mapping must start at offset 0 and may not extend past the data area,
+ * which for a mirrored ring is mapped twice back to back like in the kernel.
+ */
+static int ringbuf_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct ringbuf *rb = ringbuf_of(file);
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long addr;
+    size_t off;
+    int ret = 0;
+
+    if (vma->vm_pgoff || !(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    mutex_lock(&rb->lock);
+    if (!rb->buf || len > PAGE_SIZE + (rb->pages ? 2 * rb->size : PAGE_ALIGN(rb->size))) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = vm_insert_page(vma, vma->vm_start, virt_to_page(rb->ctl));
+    for (addr = vma->vm_start + PAGE_SIZE, off = 0; !ret && addr < vma->vm_end;
+         addr += PAGE_SIZE, off += PAGE_SIZE)
+        ret = vm_insert_page(vma, addr, vmalloc_to_page(rb->buf + off));
+    if (ret)
+        goto out;
+
+    vma->vm_ops = &ringbuf_vm_ops;
+    vma->vm_private_data = rb;
+    atomic_inc(&rb->mmap_count);
+out:
+    mutex_unlock(&rb->lock);
+    return ret;
+}
+
 /* fops struct */
 static const struct file_operations ringbuf_fops = {
     .owner = THIS_MODULE,
+    .llseek = no_llseek,
+    .read_iter = ringbuf_read_iter,
+    .write_iter = ringbuf_write_iter,
+    .splice_read = ringbuf_splice_read,
+    .splice_write = ringbuf_splice_write,
+    .poll = ringbuf_poll,
     .unlocked_ioctl = ringbuf_ioctl,
+    .mmap = ringbuf_mmap,
     .open = ringbuf_open,
     .release = ringbuf_release,
 };
 
+/*
+ * sysfs: /sys/class/ringbufdev/ringbufdevN/stats/, one value per file.
+ * The counters are per-CPU sums; count is the current number of queued
+ * bytes and count_hw its high-water mark, sampled whenever push or pop
+ * reloads the other side's position.
+ */
+static u64 ringbuf_stat_sum(struct ringbuf *rb, size_t off)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += *(u64 *)((char *)per_cpu_ptr(rb->stats, cpu) + off);
+    return sum;
+}
+
+#define RINGBUF_STAT_ATTR(field)                                                \
+static ssize_t field##_show(struct device *dev, struct device_attribute *attr,  \
+                            char *buf)                                          \
+{                                                                               \
+    struct ringbuf *rb = dev_get_drvdata(dev);                                  \
+                                                                                \
+    return sysfs_emit(buf, "%llu\n", (unsigned long long)ringbuf_stat_sum(rb,   \
+                      offsetof(struct ringbuf_stats, field)));                  \
+}                                                                               \
+static DEVICE_ATTR_RO(field)
+
+RINGBUF_STAT_ATTR(bytes_pushed);
+RINGBUF_STAT_ATTR(msgs_pushed);
+RINGBUF_STAT_ATTR(bytes_popped);
+RINGBUF_STAT_ATTR(msgs_popped);
+RINGBUF_STAT_ATTR(enospc);
+RINGBUF_STAT_ATTR(waits);
+RINGBUF_STAT_ATTR(wait_ns);
+RINGBUF_STAT_ATTR(wakeups);
+
+static ssize_t count_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ringbuf *rb = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%zu\n", ringbuf_count(rb));
+}
+static DEVICE_ATTR_RO(count);
+
+static ssize_t count_hw_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ringbuf *rb = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%zu\n", READ_ONCE(rb->count_hw));
+}
+static DEVICE_ATTR_RO(count_hw);
+
+static struct attribute *ringbuf_stats_attrs[] = {
+    &dev_attr_bytes_pushed.attr,
+    &dev_attr_msgs_pushed.attr,
+    &dev_attr_bytes_popped.attr,
+    &dev_attr_msgs_popped.attr,
+    &dev_attr_enospc.attr,
+    &dev_attr_waits.attr,
+    &dev_attr_wait_ns.attr,
+    &dev_attr_wakeups.attr,
+    &dev_attr_count.attr,
+    &dev_attr_count_hw.attr,
+    NULL,
+};
+
+static const struct attribute_group ringbuf_stats_group = {
+    .name = "stats",
+    .attrs = ringbuf_stats_attrs,
+};
+
+static const struct attribute_group *ringbuf_groups[] = {
+    &ringbuf_stats_group,
+    NULL,
+};
+
+/* Helper: set up one queue instance; its buffer comes with SET_SIZE_OF_QUEUE */
+static int ringbuf_create(struct ringbuf *rb, int id)
+{
+    int ret;
+
+    rb->id = id;
+    init_waitqueue_head(&rb->rq);
+    init_waitqueue_head(&rb->wq);
+    rb->wr_need = SIZE_MAX;
+    mutex_init(&rb->lock);
+    atomic_set(&rb->mmap_count, 0);
+    ret = init_srcu_struct(&rb->srcu);
+    if (ret)
+        return ret;
+
+    rb->stats = alloc_percpu(struct ringbuf_stats);
+    if (!rb->stats) {
+        cleanup_srcu_struct(&rb->srcu);
+        return -ENOMEM;
+    }
+
+    /* head/tail page, kept for the queue's lifetime so mappings stay valid */
+    rb->ctl = (struct ringbuf_ctl *)get_zeroed_page(GFP_KERNEL);
+    if (!rb->ctl) {
+        free_percpu(rb->stats);
+        cleanup_srcu_struct(&rb->srcu);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* Helper: release everything ringbuf_create() and SET_SIZE_OF_QUEUE set up */
+static void ringbuf_destroy(struct ringbuf *rb)
+{
+    ringbuf_free(rb);
+    free_page((unsigned long)rb->ctl);
+    kvfree(rb->marks);
+    free_percpu(rb->stats);
+    cleanup_srcu_struct(&rb->srcu);
+}
+
 /* module init/exit */
 static int __init ringbuf_init_module(void)
 {
+    unsigned int i, created;
     int ret;
 
-    ret = alloc_chrdev_region(&devnum, 0, 1, DEVICE_NAME);
+    if (nr_queues == 0 || nr_queues > RINGBUF_MAX_QUEUES) {
+        pr_err("ringbuf: nr_queues must be 1..%d\n", RINGBUF_MAX_QUEUES);
+        return -EINVAL;
+    }
+
+    /* page-aligned, unlike kcalloc(): see the cache-line layout of struct ringbuf */
+    rbs = alloc_pages_exact(nr_queues * sizeof(*rbs), GFP_KERNEL | __GFP_ZERO);
+    if (!rbs)
+        return -ENOMEM;
+
+    for (created = 0; created < nr_queues; ++created) {
+        ret = ringbuf_create(&rbs[created], created);
+        if (ret)
+            goto err_queues;
+    }
+
+    ret = alloc_chrdev_region(&devnum, 0, nr_queues, DEVICE_NAME);
     if (ret) {
         pr_err("ringbuf: alloc_chrdev_region failed: %d\n", ret);
-        return ret;
+        goto err_queues;
     }
 
     cdev_init(&rb_cdev, &ringbuf_fops);
-    ret = cdev_add(&rb_cdev, devnum, 1);
+    ret = cdev_add(&rb_cdev, devnum, nr_queues);
     if (ret) {
         pr_err("ringbuf: cdev_add failed: %d\n", ret);
-        unregister_chrdev_region(devnum, 1);
-        return ret;
+        goto err_region;
     }
 
     rb_class = class_create(THIS_MODULE, DEVICE_NAME);
     if (IS_ERR(rb_class)) {
         pr_err("ringbuf: class_create failed\n");
-        cdev_del(&rb_cdev);
-        unregister_chrdev_region(devnum, 1);
-        return PTR_ERR(rb_class);
+        ret = PTR_ERR(rb_class);
+        goto err_cdev;
     }
 
-    if (IS_ERR(device_create(rb_class, NULL, devnum, NULL, DEVICE_NAME))) {
-        pr_err("ringbuf: device_create failed\n");
-        class_destroy(rb_class);
-        cdev_del(&rb_cdev);
-        unregister_chrdev_region(devnum, 1);
-        return -ENOMEM;
+    for (i = 0; i < nr_queues; ++i) {
+        if (IS_ERR(device_create_with_groups(rb_class, NULL,
+                                             MKDEV(MAJOR(devnum), MINOR(devnum) + i),
+                                             &rbs[i], ringbuf_groups, DEVICE_NAME "%u", i))) {
+            pr_err("ringbuf: device_create failed for queue %u\n", i);
+            ret = -ENOMEM;
+            goto err_devices;
+        }
     }
 
-    pr_info("ringbuf: driver loaded, /dev/%s created\n", DEVICE_NAME);
+    pr_info("ringbuf: driver loaded, /dev/%s0..%u created\n", DEVICE_NAME, nr_queues - 1);
     return 0;
+
+err_devices:
+    while (i--)
+        device_destroy(rb_class, MKDEV(MAJOR(devnum), MINOR(devnum) + i));
+    class_destroy(rb_class);
+err_cdev:
+    cdev_del(&rb_cdev);
+err_region:
+    unregister_chrdev_region(devnum, nr_queues);
+err_queues:
+    while (created--)
+        ringbuf_destroy(&rbs[created]);
+    free_pages_exact(rbs, nr_queues * sizeof(*rbs));
+    return ret;
 }
 
 static void __exit ringbuf_cleanup_module(void)
 {
-    ringbuf_free();
-    device_destroy(rb_class, devnum);
+    unsigned int i;
+
+    for (i = 0; i < nr_queues; ++i)
+        device_destroy(rb_class, MKDEV(MAJOR(devnum), MINOR(devnum) + i));
     class_destroy(rb_class);
     cdev_del(&rb_cdev);
-    unregister_chrdev_region(devnum, 1);
+    unregister_chrdev_region(devnum, nr_queues);
+    for (i = 0; i < nr_queues; ++i)
+        ringbuf_destroy(&rbs[i]);
+    free_pages_exact(rbs, nr_queues * sizeof(*rbs));
     pr_info("ringbuf: driver unloaded\n");
 }
 
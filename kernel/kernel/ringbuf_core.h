@@ -0,0 +1,1248 @@
+/*
+ * ringbuf_core.h - the ring itself: layout, push/pop copy core, record
+ * framing, latency marks, resize, mode changes, the wait conditions, the
+ * blocking push and pop built on them and per-reader low watermarks
+ *
+ * Included once by the module (ringbuf.c) and once by the userspace build
+ * (user/ringbuf_lib.c), which supplies the kernel APIs used here from
+ * user/ringbuf_shim.h. Before including it, the includer provides those
+ * APIs, ringbuf_free_buf() and the ringbuf tracepoints. Besides
+ * ringbuf_quiesce(), only the blocking push and pop at the end sleep.
+ */
+
+#ifndef RINGBUF_CORE_H
+#define RINGBUF_CORE_H
+
+/*
+ * Per-CPU event counters, summed when read through sysfs so the data path
+ * never writes a shared cache line for them
+ */
+struct ringbuf_stats {
+    u64 bytes_pushed;
+    u64 msgs_pushed;
+    u64 bytes_popped;
+    u64 msgs_popped;
+    u64 enospc;      /* pushes that found too little free space */
+    u64 waits;       /* times a push or pop blocked */
+    u64 wait_ns;     /* total time spent blocked */
+    u64 wakeups;     /* wake_up calls issued on rq or wq */
+    u64 lat_unmarked; /* RINGBUF_MODE_LATENCY pushes with no free mark */
+    u64 lat_hist[RINGBUF_LAT_BUCKETS]; /* see GET_LATENCY_HIST */
+};
+
+/*
+ * RINGBUF_MODE_LATENCY: each push records where it ended and when. The
+ * marks form a ring of their own, produced and consumed alongside the data
+ * under the same push/pop serialisation, so it needs no lock either.
+ */
+#define RINGBUF_LAT_MARKS 4096 /* power of two */
+
+struct ringbuf_mark {
+    u64 pos; /* tail after the push */
+    u64 ns;  /* ktime_get_ns() at the push */
+};
+
+/*
+ * Circular queue structure
+ *
+ * head and tail live in a zeroed page shared with userspace (struct
+ * ringbuf_ctl) so that mmap() users can produce and consume without a
+ * syscall. They are free-running byte counters: tail - head is the number
+ * of bytes queued and a position maps to buf[pos % size].
+ *
+ * Push only writes tail and pop only writes head, each with a release
+ * store after the data copy. Pushes are serialised against each other by
+ * the mutex, as are pops, which is all a single producer/single consumer
+ * queue needs: in RINGBUF_MODE_SPSC the data path skips the mutex and only
+ * holds an SRCU read lock, which keeps buf alive across a resize.
+ *
+ * The fields are grouped by who writes them, each group on its own cache
+ * line(s): what only changes on resize or mode changes, the mutex, then
+ * what the producer and the consumer write on their paths, and count_hw,
+ * which both sides check but seldom write. Each side keeps a cached copy
+ * of the other side's position and only reloads it from the ctl page when
+ * the copy says it is out of space or data, so a side that keeps up does
+ * not touch the other's line at all.
+ *
+ * The alignment only holds where the struct itself is cache-line aligned:
+ * the module allocates its queues with alloc_pages_exact(), the userspace
+ * library with aligned_alloc().
+ */
+struct ringbuf {
+    /* read-mostly */
+    char *buf;               /* vmalloc_user'd buffer, or mirrored: see ringbuf_alloc() */
+    struct page **pages;     /* mirrored buffer's pages, NULL if not mirrored */
+    size_t size;             /* capacity */
+    size_t mask;             /* size - 1 if size is a power of two > 1, else 0 */
+    struct ringbuf_ctl *ctl; /* shared head/tail page */
+    int mode;                /* RINGBUF_MODE_* bits */
+    int id;                  /* N in /dev/ringbufdevN */
+    atomic_t mmap_count;     /* live user mappings of buf/ctl */
+    struct ringbuf_stats __percpu *stats;
+    struct ringbuf_mark *marks; /* push timestamps, allocated on first use */
+    struct srcu_struct srcu; /* pins buf for lockless SPSC push/pop */
+
+    struct mutex lock ____cacheline_aligned_in_smp; /* protect structure */
+
+    /* producer side */
+    wait_queue_head_t wq ____cacheline_aligned_in_smp; /* writers wait queue (also mmap producers, pollers) */
+    size_t wr_need;          /* smallest free space a blocked writer waits for */
+    u64 cached_head;         /* ctl->head as last seen by push */
+    u64 msgs_in;             /* records pushed in RINGBUF_MODE_MSG */
+    u64 mark_tail;           /* next mark to fill, owned by push */
+
+    /* consumer side */
+    wait_queue_head_t rq ____cacheline_aligned_in_smp; /* readers wait queue */
+    u64 cached_tail;         /* ctl->tail as last seen by pop */
+    u64 msgs_out;            /* records popped in RINGBUF_MODE_MSG */
+    u64 mark_head;           /* next mark to retire, owned by pop */
+
+    /* raised by both sides, but only on a new maximum */
+    size_t count_hw ____cacheline_aligned_in_smp; /* high-water mark of queued bytes */
+};
+
+#define ringbuf_stat_add(rb, field, n) this_cpu_add((rb)->stats->field, (n))
+
+/*
+ * largest queue SET_SIZE_OF_QUEUE64 accepts; keeps size plus a record
+ * header and PAGE_ALIGN(size) from overflowing a size_t
+ */
+#define RINGBUF_MAX_SIZE (SIZE_MAX / 2)
+
+/* capacity to allocate for a requested size: RINGBUF_MODE_POW2 rounds up */
+static inline u64 ringbuf_round_size(int mode, u64 sz)
+{
+    if (mode & RINGBUF_MODE_POW2 && sz && sz <= RINGBUF_MAX_SIZE)
+        return roundup_pow_of_two((unsigned long)sz);
+    return sz;
+}
+
+/* Helper: free ring buffer */
+static void ringbuf_free(struct ringbuf *rb)
+{
+    if (rb->buf) {
+        ringbuf_free_buf(rb->buf, rb->pages, rb->size);
+        rb->buf = NULL;
+        rb->pages = NULL;
+    }
+    rb->size = 0;
+    rb->mask = 0;
+    rb->ctl->head = rb->ctl->tail = rb->ctl->size = 0;
+    rb->ctl->flags = 0;
+    rb->cached_head = rb->cached_tail = 0;
+}
+
+/* bytes currently queued (lockless snapshot, may be stale) */
+static inline size_t ringbuf_count(struct ringbuf *rb)
+{
+    return (size_t)(READ_ONCE(rb->ctl->tail) - READ_ONCE(rb->ctl->head));
+}
+
+/*
+ * RINGBUF_MODE_MSG records queued, as pushed and popped through the core
+ * (lockless snapshot, may be stale). The mode bit only changes while the
+ * queue is empty, so both counters agree whenever it does.
+ */
+static inline u64 ringbuf_msgs(struct ringbuf *rb)
+{
+    u64 out = READ_ONCE(rb->msgs_out);
+    u64 in = READ_ONCE(rb->msgs_in);
+
+    return in > out ? in - out : 0;
+}
+
+/*
+ * Snapshot head and tail. The acquire loads pair with the release stores
+ * that publish them, so data written before a position was advanced is
+ * visible once the new position is. A mapped ctl page is user-writable,
+ * so reject indices that do not describe at most rb->size queued bytes.
+ */
+static inline int ringbuf_snapshot(struct ringbuf *rb, u64 *head, u64 *tail)
+{
+    *head = smp_load_acquire(&rb->ctl->head);
+    *tail = smp_load_acquire(&rb->ctl->tail);
+    if (*tail - *head > rb->size)
+        return -EIO;
+    return 0;
+}
+
+/*
+ * raise count_hw to count; reads first so that only a new high-water mark
+ * writes the shared line (same cmpxchg loop as ringbuf_need_space())
+ */
+static inline void ringbuf_note_count(struct ringbuf *rb, size_t count)
+{
+    size_t cur = READ_ONCE(rb->count_hw);
+    size_t old;
+
+    while (count > cur) {
+        old = cmpxchg(&rb->count_hw, cur, count);
+        if (old == cur)
+            break;
+        cur = old;
+    }
+}
+
+/*
+ * The producer's snapshot: its own tail, and head from rb->cached_head as
+ * long as that leaves room for need bytes. head only moves forward, so a
+ * stale copy only understates the free space; ctl->head is loaded again
+ * (and validated) once the copy no longer shows enough room. Returns 1 if
+ * it was, 0 if the cached copy was used.
+ */
+static inline int ringbuf_push_snapshot(struct ringbuf *rb, size_t need, u64 *head, u64 *tail)
+{
+    *tail = READ_ONCE(rb->ctl->tail);
+    *head = rb->cached_head;
+    if (*tail - *head <= rb->size && rb->size - (size_t)(*tail - *head) >= need)
+        return 0;
+
+    *head = smp_load_acquire(&rb->ctl->head);
+    rb->cached_head = *head;
+    if (*tail - *head > rb->size)
+        return -EIO;
+    return 1;
+}
+
+/*
+ * the consumer's side of the same: tail is reloaded once want bytes are not
+ * cached, and the fresh count feeds count_hw (see ringbuf_push_iter())
+ */
+static inline int ringbuf_pop_snapshot(struct ringbuf *rb, size_t want, u64 *head, u64 *tail)
+{
+    *head = READ_ONCE(rb->ctl->head);
+    *tail = rb->cached_tail;
+    if (*tail - *head <= rb->size && *tail - *head >= want)
+        return 0;
+
+    *tail = smp_load_acquire(&rb->ctl->tail);
+    rb->cached_tail = *tail;
+    if (*tail - *head > rb->size)
+        return -EIO;
+    ringbuf_note_count(rb, (size_t)(*tail - *head));
+    return 1;
+}
+
+/*
+ * buffer offset of a free-running position: a mask for power-of-two
+ * capacities, a 64-bit division otherwise
+ */
+static inline size_t ringbuf_off(struct ringbuf *rb, u64 pos)
+{
+    u64 rem;
+
+    if (rb->mask)
+        return (size_t)(pos & rb->mask);
+    div64_u64_rem(pos, rb->size, &rem);
+    return (size_t)rem;
+}
+
+/* how much of len bytes at off is contiguous in buf: all of it if mirrored */
+static inline size_t ringbuf_span(struct ringbuf *rb, size_t off, size_t len)
+{
+    return rb->pages ? len : min(len, rb->size - off);
+}
+
+/*
+ * Copy the queued bytes [head, tail) into nbuf, a ring of nsize bytes, at
+ * the same positions, so head and tail stay valid across a resize. Each
+ * step copies up to the nearer wrap point of the two rings (nbuf is
+ * treated as unmirrored, which is correct either way).
+ */
+static void ringbuf_move(struct ringbuf *rb, char *nbuf, size_t nsize, u64 head, u64 tail)
+{
+    size_t from, n;
+    u64 pos, to;
+
+    for (pos = head; pos != tail; pos += n) {
+        from = ringbuf_off(rb, pos);
+        div64_u64_rem(pos, nsize, &to);
+        n = min_t(u64, tail - pos, min(ringbuf_span(rb, from, rb->size), nsize - (size_t)to));
+        memcpy(nbuf + to, rb->buf + from, n);
+    }
+}
+
+/*
+ * Helper: switch the queue to nbuf/npages of nsize bytes from
+ * ringbuf_alloc(), keeping its contents (caller holds the mutex with SPSC
+ * quiesced and no mappings). Fails with -ENOSPC if the queued data would
+ * not fit; nbuf is then left to the caller. Waiters, the mutex and the
+ * positions are left alone, so blocked readers and writers simply sleep on.
+ */
+static int ringbuf_resize(struct ringbuf *rb, char *nbuf, struct page **npages,
+                          size_t nsize)
+{
+    char *old = rb->buf;
+    struct page **opages = rb->pages;
+    size_t osize = rb->size;
+    u64 head = 0, tail = 0;
+
+    if (old) {
+        if (ringbuf_snapshot(rb, &head, &tail))
+            return -EIO;
+        if (tail - head > nsize)
+            return -ENOSPC;
+        ringbuf_move(rb, nbuf, nsize, head, tail);
+    }
+
+    rb->buf = nbuf;
+    rb->pages = npages;
+    rb->mask = nsize > 1 && is_power_of_2(nsize) ? nsize - 1 : 0;
+    WRITE_ONCE(rb->size, nsize);
+    rb->ctl->size = nsize;
+    rb->ctl->flags = npages ? RINGBUF_CTL_MIRROR : 0;
+    if (old)
+        ringbuf_free_buf(old, opages, osize);
+    pr_info("ringbuf%d: resized buffer to %zu bytes, %llu queued\n", rb->id, nsize,
+            (unsigned long long)(tail - head));
+    return 0;
+}
+
+/* stamp a push that ends at pos (before pos is published as the tail) */
+static void ringbuf_mark_push(struct ringbuf *rb, u64 pos)
+{
+    u64 mtail = rb->mark_tail;
+    struct ringbuf_mark *m;
+
+    if (mtail - smp_load_acquire(&rb->mark_head) == RINGBUF_LAT_MARKS) {
+        ringbuf_stat_add(rb, lat_unmarked, 1);
+        return;
+    }
+
+    m = &rb->marks[mtail & (RINGBUF_LAT_MARKS - 1)];
+    m->pos = pos;
+    m->ns = ktime_get_ns();
+    smp_store_release(&rb->mark_tail, mtail + 1);
+}
+
+/*
+ * after a pop up to head: every push that ended at or before head has now
+ * been consumed in full; bucket its residency by log2 of nanoseconds
+ */
+static void ringbuf_mark_pop(struct ringbuf *rb, u64 head)
+{
+    u64 mhead = rb->mark_head;
+    u64 mtail = smp_load_acquire(&rb->mark_tail);
+    struct ringbuf_mark *m;
+    u64 now;
+
+    if (mhead == mtail)
+        return;
+
+    now = ktime_get_ns();
+    for (; mhead != mtail; ++mhead) {
+        m = &rb->marks[mhead & (RINGBUF_LAT_MARKS - 1)];
+        if (m->pos > head)
+            break;
+        ringbuf_stat_add(rb, lat_hist[min(fls64(now - m->ns), RINGBUF_LAT_BUCKETS - 1)], 1);
+    }
+    smp_store_release(&rb->mark_head, mhead);
+}
+
+/* is the queue framing records (RINGBUF_MODE_MSG)? */
+static inline bool ringbuf_msg_mode(struct ringbuf *rb)
+{
+    return READ_ONCE(rb->mode) & RINGBUF_MODE_MSG;
+}
+
+/*
+ * Copy len bytes between the ring at position pos and an iterator, in at
+ * most two contiguous pieces: pos..end of buffer, then from the start
+ * (a single piece in a mirrored ring).
+ * Page faults are disabled so a non-resident user page cannot sleep with
+ * the mutex held; the return value is the number of bytes copied.
+ */
+static size_t ringbuf_copy_from_iter(struct ringbuf *rb, u64 pos, size_t len,
+                                     struct iov_iter *from)
+{
+    size_t off = ringbuf_off(rb, pos);
+    size_t first = ringbuf_span(rb, off, len);
+    size_t copied;
+
+    pagefault_disable();
+    copied = copy_from_iter(rb->buf + off, first, from);
+    if (copied == first)
+        copied += copy_from_iter(rb->buf, len - first, from);
+    pagefault_enable();
+    return copied;
+}
+
+static size_t ringbuf_copy_to_iter(struct ringbuf *rb, u64 pos, size_t len,
+                                   struct iov_iter *to)
+{
+    size_t off = ringbuf_off(rb, pos);
+    size_t first = ringbuf_span(rb, off, len);
+    size_t copied;
+
+    pagefault_disable();
+    copied = copy_to_iter(rb->buf + off, first, to);
+    if (copied == first)
+        copied += copy_to_iter(rb->buf, len - first, to);
+    pagefault_enable();
+    return copied;
+}
+
+/* record headers: a u32 payload length, unaligned and wrapping like data */
+static void ringbuf_put_hdr(struct ringbuf *rb, u64 pos, u32 len)
+{
+    size_t off = ringbuf_off(rb, pos);
+    size_t first = ringbuf_span(rb, off, RINGBUF_MSG_HDR_LEN);
+
+    memcpy(rb->buf + off, &len, first);
+    memcpy(rb->buf, (char *)&len + first, RINGBUF_MSG_HDR_LEN - first);
+}
+
+static u32 ringbuf_get_hdr(struct ringbuf *rb, u64 pos)
+{
+    size_t off = ringbuf_off(rb, pos);
+    size_t first = ringbuf_span(rb, off, RINGBUF_MSG_HDR_LEN);
+    u32 len;
+
+    memcpy(&len, rb->buf + off, first);
+    memcpy((char *)&len + first, rb->buf, RINGBUF_MSG_HDR_LEN - first);
+    return len;
+}
+
+/*
+ * push bytes from an iterator into ring (caller must hold mutex, or be the
+ * only producer of an SPSC queue inside an rb->srcu read section)
+ *
+ * PUSH_DATA is all-or-nothing; write() (partial == true) stores as much as
+ * fits. In RINGBUF_MODE_MSG every push is all-or-nothing and stores one
+ * record: a header with the length, then the payload. A fault that leaves
+ * nothing to commit reverts the iterator and returns -EFAULT; the caller
+ * faults the range in unlocked and retries.
+ */
+static ssize_t ringbuf_push_iter(struct ringbuf *rb, struct iov_iter *from, bool partial)
+{
+    size_t len = iov_iter_count(from);
+    size_t hdr = 0, space, copied;
+    u64 head, tail;
+    int fresh;
+
+    if (ringbuf_msg_mode(rb)) {
+        if (len > U32_MAX)
+            return -EMSGSIZE;
+        hdr = RINGBUF_MSG_HDR_LEN;
+        partial = false;
+    }
+    fresh = ringbuf_push_snapshot(rb, hdr + len, &head, &tail);
+    if (fresh < 0)
+        return fresh;
+
+    space = rb->size - (size_t)(tail - head);
+    if (hdr + len > space) {
+        if (!partial || !space) {
+            ringbuf_stat_add(rb, enospc, 1);
+            return -ENOSPC; /* no enough space */
+        }
+        len = space;
+    }
+
+    /* the payload goes after the header slot, if any */
+    copied = ringbuf_copy_from_iter(rb, tail + hdr, len, from);
+    if (copied != len && (!partial || !copied)) {
+        iov_iter_revert(from, copied);
+        return -EFAULT;
+    }
+    if (hdr)
+        ringbuf_put_hdr(rb, tail, (u32)len);
+    if (READ_ONCE(rb->mode) & RINGBUF_MODE_LATENCY)
+        ringbuf_mark_push(rb, tail + hdr + copied);
+
+    /* publish the bytes before the new tail */
+    smp_store_release(&rb->ctl->tail, tail + hdr + copied);
+    if (hdr)
+        WRITE_ONCE(rb->msgs_in, rb->msgs_in + 1);
+    ringbuf_stat_add(rb, bytes_pushed, copied);
+    ringbuf_stat_add(rb, msgs_pushed, 1);
+    trace_ringbuf_push(rb->id, copied, (size_t)(tail - head),
+                       (size_t)(tail - head) + hdr + copied);
+    /* a cached head overstates the count; pop notes it when it resyncs */
+    if (fresh)
+        ringbuf_note_count(rb, (size_t)(tail - head) + hdr + copied);
+    return (ssize_t)copied;
+}
+
+/*
+ * pop up to iov_iter_count(to) bytes from ring (same rules as push). Bytes
+ * that reached the destination are consumed even if a fault cut the copy
+ * short; -EFAULT means nothing was copied.
+ *
+ * In RINGBUF_MODE_MSG exactly one whole record is popped, or none: a
+ * record larger than the destination stays queued and -EMSGSIZE is
+ * returned, and a fault consumes nothing.
+ */
+static ssize_t ringbuf_pop_iter(struct ringbuf *rb, struct iov_iter *to)
+{
+    size_t tocopy = iov_iter_count(to);
+    size_t hdr = 0, copied;
+    u64 head, tail;
+    u32 reclen;
+
+    /* a record is published whole, so a cached tail past its header covers it */
+    if (ringbuf_msg_mode(rb))
+        hdr = RINGBUF_MSG_HDR_LEN;
+    if (ringbuf_pop_snapshot(rb, hdr ? hdr + 1 : tocopy, &head, &tail) < 0)
+        return -EIO;
+    if (tail == head)
+        return 0;
+
+    if (hdr) {
+        /* a mapped ctl page is user-writable: validate the header too */
+        if (tail - head < hdr)
+            return -EIO;
+        reclen = ringbuf_get_hdr(rb, head);
+        if (!reclen || reclen > tail - head - hdr)
+            return -EIO;
+        if (reclen > tocopy)
+            return -EMSGSIZE;
+        tocopy = reclen;
+    } else if (tocopy > (size_t)(tail - head)) {
+        tocopy = (size_t)(tail - head);
+    }
+
+    copied = ringbuf_copy_to_iter(rb, head + hdr, tocopy, to);
+    if (!copied || (hdr && copied != tocopy)) {
+        iov_iter_revert(to, copied);
+        return -EFAULT;
+    }
+
+    /* release the space only after the bytes have been read out */
+    smp_store_release(&rb->ctl->head, head + hdr + copied);
+    if (hdr)
+        WRITE_ONCE(rb->msgs_out, rb->msgs_out + 1);
+    if (READ_ONCE(rb->mode) & RINGBUF_MODE_LATENCY)
+        ringbuf_mark_pop(rb, head + hdr + copied);
+    ringbuf_stat_add(rb, bytes_popped, copied);
+    ringbuf_stat_add(rb, msgs_popped, 1);
+    trace_ringbuf_pop(rb->id, copied, (size_t)(tail - head),
+                      (size_t)(tail - head) - hdr - copied);
+    return (ssize_t)copied;
+}
+
+/*
+ * Enter the data path: lockless for SPSC queues, under the mutex otherwise.
+ * Returns the SRCU index to hand to ringbuf_exit(), or -1 if the mutex was
+ * taken. The mode is checked inside the read section, see ringbuf_quiesce().
+ */
+static int ringbuf_enter(struct ringbuf *rb)
+{
+    int idx;
+
+    idx = srcu_read_lock(&rb->srcu);
+    if (smp_load_acquire(&rb->mode) & RINGBUF_MODE_SPSC)
+        return idx;
+    srcu_read_unlock(&rb->srcu, idx);
+
+    mutex_lock(&rb->lock);
+    return -1;
+}
+
+static void ringbuf_exit(struct ringbuf *rb, int idx)
+{
+    if (idx < 0)
+        mutex_unlock(&rb->lock);
+    else
+        srcu_read_unlock(&rb->srcu, idx);
+}
+
+/* one push attempt */
+static ssize_t ringbuf_push_once(struct ringbuf *rb, struct iov_iter *from, bool partial)
+{
+    ssize_t ret;
+    int idx;
+
+    idx = ringbuf_enter(rb);
+    ret = ringbuf_push_iter(rb, from, partial);
+    ringbuf_exit(rb, idx);
+    return ret;
+}
+
+/* one pop attempt, returns 0 if the queue was empty */
+static ssize_t ringbuf_pop_once(struct ringbuf *rb, struct iov_iter *to)
+{
+    ssize_t ret;
+    int idx;
+
+    idx = ringbuf_enter(rb);
+    ret = ringbuf_pop_iter(rb, to);
+    ringbuf_exit(rb, idx);
+    return ret;
+}
+
+/*
+ * Route all push/pop through the mutex and wait for lockless SPSC callers
+ * to leave buf (caller holds mutex). Returns the mode to hand to
+ * ringbuf_resume() once buf may be used locklessly again.
+ */
+static int ringbuf_quiesce(struct ringbuf *rb)
+{
+    int mode = rb->mode;
+
+    WRITE_ONCE(rb->mode, mode & ~RINGBUF_MODE_SPSC);
+    synchronize_srcu(&rb->srcu);
+    return mode;
+}
+
+/*
+ * Set the mode after ringbuf_quiesce() (caller holds mutex). The release
+ * pairs with the acquire in ringbuf_enter(): a lockless caller that sees
+ * RINGBUF_MODE_SPSC again also sees the new buf, size and mask.
+ */
+static void ringbuf_resume(struct ringbuf *rb, int mode)
+{
+    smp_store_release(&rb->mode, mode);
+}
+
+/*
+ * SET_QUEUE_MODE from old to mode (caller holds mutex, SPSC quiesced). The
+ * framing can only change while the queue is empty; turning on
+ * RINGBUF_MODE_LATENCY starts with no marks, so data already queued is
+ * not measured.
+ */
+static int ringbuf_set_mode(struct ringbuf *rb, int old, int mode)
+{
+    if ((old ^ mode) & RINGBUF_MODE_MSG && ringbuf_count(rb))
+        return -EBUSY; /* queued bytes would be misread */
+
+    if (mode & ~old & RINGBUF_MODE_LATENCY) {
+        if (!rb->marks) {
+            rb->marks = kvmalloc_array(RINGBUF_LAT_MARKS, sizeof(*rb->marks), GFP_KERNEL);
+            if (!rb->marks)
+                return -ENOMEM;
+        }
+        rb->mark_head = rb->mark_tail = 0;
+    }
+    return 0;
+}
+
+/*
+ * Wait conditions and wakeups: when a push or pop has to sleep, and whom a
+ * push or pop wakes
+ */
+
+/* a SET_LOWAT low watermark, see struct queue_lowat */
+struct ringbuf_lowat {
+    size_t bytes;
+    u32 msgs;
+    s64 max_ns;                  /* < 0: no limit */
+    ktime_t due;                 /* set by ringbuf_get_lowat(): poll()'s due time */
+};
+
+/* free bytes (lockless snapshot, may be stale) */
+static inline size_t ringbuf_space(struct ringbuf *rb)
+{
+    size_t size = READ_ONCE(rb->size);
+    size_t count = ringbuf_count(rb);
+
+    return count < size ? size - count : 0;
+}
+
+/*
+ * free bytes a push of len bytes waits for: all of it plus a record header
+ * in RINGBUF_MODE_MSG, the whole message for PUSH_DATA, one byte for write()
+ */
+static inline size_t ringbuf_need(struct ringbuf *rb, size_t len, bool partial)
+{
+    if (ringbuf_msg_mode(rb))
+        return RINGBUF_MSG_HDR_LEN + len;
+    return partial ? 1 : len;
+}
+
+/*
+ * after a push: wake pollers and the first nr blocked readers whose low
+ * watermark is met (skip the waitqueue lock if none). Readers sleep
+ * exclusively, in arrival order, so a push only wakes as many as it can
+ * feed: one per record in RINGBUF_MODE_MSG, one for a byte-stream push
+ * since a single pop takes all it has room for. A woken reader that leaves
+ * data behind hands the wake on, see ringbuf_pass_wake().
+ */
+static void ringbuf_wake_readers(struct ringbuf *rb, int nr)
+{
+    if (!wq_has_sleeper(&rb->rq))
+        return;
+
+    __wake_up(&rb->rq, TASK_INTERRUPTIBLE, nr, poll_to_key(EPOLLIN | EPOLLRDNORM));
+    ringbuf_stat_add(rb, wakeups, 1);
+    trace_ringbuf_wake(rb->id, false, ringbuf_count(rb));
+}
+
+/*
+ * a reader that slept and is leaving, with or without data, wakes the next
+ * one in line if anything is still queued: it may have been woken for data
+ * that another reader took, or have taken only part of it
+ */
+static void ringbuf_pass_wake(struct ringbuf *rb)
+{
+    if (ringbuf_count(rb) > 0)
+        ringbuf_wake_readers(rb, 1);
+}
+
+/*
+ * lower wr_need to need unless a smaller request is already waiting; true
+ * if no writer was advertised before
+ */
+static bool ringbuf_need_space(struct ringbuf *rb, size_t need)
+{
+    size_t cur = READ_ONCE(rb->wr_need);
+    size_t old;
+
+    while (need < cur) {
+        old = cmpxchg(&rb->wr_need, cur, need);
+        if (old == cur)
+            return cur == SIZE_MAX;
+        cur = old;
+    }
+    return false;
+}
+
+/*
+ * Advertise a writer (or EPOLLOUT poller) waiting for need free bytes: in
+ * wr_need, so ringbuf_wake_writers() wakes wq once the smallest such need
+ * fits, and while the queue is mapped in space_waiters, so an mmap
+ * consumer calls NOTIFY_QUEUE. The caller issues a full barrier before it
+ * re-checks the space; it pairs with the one in ringbuf_wake_writers() and
+ * rb_map_notify().
+ *
+ * A blocked writer makes readers below their low watermark take what is
+ * queued, see ringbuf_readable(), so the first writer to advertise wakes
+ * one to let it in. That includes a writer that ringbuf_wake_writers()
+ * woke but that still does not fit: the wake cleared wr_need.
+ */
+static void ringbuf_want_space(struct ringbuf *rb, size_t need)
+{
+    if (ringbuf_need_space(rb, need))
+        ringbuf_wake_readers(rb, 1);
+    if (atomic_read(&rb->mmap_count))
+        WRITE_ONCE(rb->ctl->space_waiters, 1);
+}
+
+/* wait condition for a writer that needs `need` free bytes */
+static bool ringbuf_writable(struct ringbuf *rb, size_t need)
+{
+    /* shrunk below need: stop waiting, the caller fails with -EMSGSIZE */
+    if (ringbuf_space(rb) >= need || need > READ_ONCE(rb->size))
+        return true;
+
+    ringbuf_want_space(rb, need);
+    smp_mb();
+    return ringbuf_space(rb) >= need;
+}
+
+/* after a pop: wake wq only if enough room was released for some waiter */
+static void ringbuf_wake_writers(struct ringbuf *rb)
+{
+    smp_mb(); /* head store before wr_need load, see ringbuf_want_space() */
+    if (ringbuf_space(rb) < READ_ONCE(rb->wr_need))
+        return;
+
+    /* every waiter re-evaluates and re-advertises what it still needs */
+    WRITE_ONCE(rb->wr_need, SIZE_MAX);
+    wake_up_interruptible_poll(&rb->wq, EPOLLOUT | EPOLLWRNORM);
+    ringbuf_stat_add(rb, wakeups, 1);
+    trace_ringbuf_wake(rb->id, true, ringbuf_count(rb));
+}
+
+/*
+ * Whether a reader with low watermark lw (NULL: none) should take the
+ * queued data: some is queued and it reaches lw->bytes (capped at the
+ * queue size) or lw->msgs records, or the queue cannot fill any further
+ * because a writer is blocked on it. msgs only counts in RINGBUF_MODE_MSG.
+ */
+static bool ringbuf_readable(struct ringbuf *rb, const struct ringbuf_lowat *lw)
+{
+    size_t count = ringbuf_count(rb);
+    u32 msgs;
+
+    if (!count)
+        return false;
+    msgs = lw && ringbuf_msg_mode(rb) ? lw->msgs : 0;
+    if (!lw || (!lw->bytes && !msgs))
+        return true;
+
+    if (lw->bytes && count >= min_t(size_t, lw->bytes, READ_ONCE(rb->size)))
+        return true;
+    if (msgs && ringbuf_msgs(rb) >= msgs)
+        return true;
+    return READ_ONCE(rb->wr_need) != SIZE_MAX;
+}
+
+/*
+ * Blocking push and pop: sleep on wq or rq until the condition above holds,
+ * a signal or a deadline
+ */
+
+/*
+ * Deadlines for blocking push/pop: an absolute ktime_get() value, or one of
+ * these. A call that would have to sleep past its deadline fails with
+ * -ETIMEDOUT, one that may not sleep at all (O_NONBLOCK) with -EAGAIN.
+ */
+#define RINGBUF_DEADLINE_NONE   KTIME_MAX
+#define RINGBUF_DEADLINE_NOWAIT ((ktime_t)-1)
+
+/* deadline timeout_ns from now (< 0: none) */
+static inline ktime_t ringbuf_deadline_after(s64 timeout_ns)
+{
+    if (timeout_ns < 0)
+        return RINGBUF_DEADLINE_NONE;
+    return ktime_add_safe(ktime_get(), ns_to_ktime(timeout_ns));
+}
+
+/*
+ * wait_event_interruptible() until an absolute deadline (or none): 0 once
+ * cond holds, -ETIMEDOUT or -ERESTARTSYS otherwise
+ */
+#define ringbuf_wait_until(wqh, cond, deadline)                         \
+({                                                                      \
+    ktime_t __exp = (deadline);                                         \
+    long __wret = 0;                                                    \
+                                                                        \
+    might_sleep();                                                      \
+    if (!(cond))                                                        \
+        __wret = ___wait_event(wqh, cond, TASK_INTERRUPTIBLE, 0, 0,     \
+            if (__exp == RINGBUF_DEADLINE_NONE) {                       \
+                schedule();                                             \
+            } else if (!schedule_hrtimeout_range(&__exp,                \
+                            current->timer_slack_ns, HRTIMER_MODE_ABS)) { \
+                __ret = -ETIMEDOUT;                                     \
+                break;                                                  \
+            });                                                         \
+    (int)__wret;                                                        \
+})
+
+/*
+ * Run wait, a sleep on one of rb's queues until cond or a deadline from
+ * ringbuf_deadline_after(); for RINGBUF_DEADLINE_NOWAIT only test cond. 0
+ * once cond holds, -EAGAIN, -ETIMEDOUT or -ERESTARTSYS otherwise. Blocking
+ * waits are counted and timed in stats and bracketed by the
+ * ringbuf_block/ringbuf_unblock tracepoints.
+ */
+#define ringbuf_wait_event(rb, writer, cond, deadline, wait)            \
+({                                                                      \
+    bool __writer = (writer);                                           \
+    int __ret;                                                          \
+    u64 __ns;                                                           \
+                                                                        \
+    if ((deadline) == RINGBUF_DEADLINE_NOWAIT) {                        \
+        __ret = (cond) ? 0 : -EAGAIN;                                   \
+    } else {                                                            \
+        trace_ringbuf_block((rb)->id, __writer, ringbuf_count(rb));     \
+        __ns = ktime_get_ns();                                          \
+        __ret = (wait);                                                 \
+        __ns = ktime_get_ns() - __ns;                                   \
+        ringbuf_stat_add(rb, waits, 1);                                 \
+        ringbuf_stat_add(rb, wait_ns, __ns);                            \
+        trace_ringbuf_unblock((rb)->id, __writer, __ret, __ns);         \
+    }                                                                   \
+    __ret;                                                              \
+})
+
+/* a reader asleep in ringbuf_wait_readable() */
+struct ringbuf_waiter {
+    struct wait_queue_entry entry;
+    struct ringbuf *rb;
+    const struct ringbuf_lowat *lw;
+};
+
+/*
+ * Wake function of a sleeping reader: decline the wake unless the reader's
+ * own condition holds, so that it is not used up on a reader below its low
+ * watermark and goes on to the next one in line
+ */
+static int ringbuf_reader_wake(struct wait_queue_entry *entry, unsigned int mode, int sync,
+                               void *key)
+{
+    struct ringbuf_waiter *w = container_of(entry, struct ringbuf_waiter, entry);
+
+    if (!ringbuf_readable(w->rb, w->lw))
+        return 0;
+    return autoremove_wake_function(entry, mode, sync, key);
+}
+
+/*
+ * Sleep as an exclusive reader on rq until ringbuf_readable(rb, lw), a
+ * signal or deadline: 0, -ERESTARTSYS or -ETIMEDOUT. A reader woken but
+ * beaten to the data goes back to the tail of the queue. While the queue
+ * is mapped it raises data_waiters before each check, as the WAIT_QUEUE
+ * condition does, so an mmap producer calls NOTIFY_QUEUE.
+ */
+static int ringbuf_wait_readable(struct ringbuf *rb, const struct ringbuf_lowat *lw,
+                                 ktime_t deadline)
+{
+    struct ringbuf_waiter w = { .rb = rb, .lw = lw };
+    int ret = 0;
+
+    init_wait(&w.entry);
+    w.entry.func = ringbuf_reader_wake;
+    for (;;) {
+        prepare_to_wait_exclusive(&rb->rq, &w.entry, TASK_INTERRUPTIBLE);
+        if (atomic_read(&rb->mmap_count)) {
+            WRITE_ONCE(rb->ctl->data_waiters, 1);
+            smp_mb();
+        }
+        if (ringbuf_readable(rb, lw))
+            break;
+        if (signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        if (deadline == RINGBUF_DEADLINE_NONE) {
+            schedule();
+        } else if (!schedule_hrtimeout_range(&deadline, current->timer_slack_ns,
+                                             HRTIMER_MODE_ABS)) {
+            ret = -ETIMEDOUT;
+            break;
+        }
+    }
+    finish_wait(&rb->rq, &w.entry);
+    return ret;
+}
+
+/* wait (up to deadline) until a reader with low watermark lw can pop */
+static int ringbuf_wait_data(struct ringbuf *rb, const struct ringbuf_lowat *lw,
+                             ktime_t deadline)
+{
+    return ringbuf_wait_event(rb, false, ringbuf_readable(rb, lw), deadline,
+                              ringbuf_wait_readable(rb, lw, deadline));
+}
+
+/*
+ * wait (up to deadline) until need bytes are free; ringbuf_writable()
+ * advertises the writer and lets readers below their low watermark in
+ */
+static int ringbuf_wait_space(struct ringbuf *rb, size_t need, ktime_t deadline)
+{
+    return ringbuf_wait_event(rb, true, ringbuf_writable(rb, need), deadline,
+                              ringbuf_wait_until(rb->wq, ringbuf_writable(rb, need), deadline));
+}
+
+/*
+ * The low watermark a pop holds out for (NULL: any data will do) and until
+ * when: lw->max_ns from now, at most deadline. Data that poll() already
+ * counts as pending keeps its clock, lw->due: once that has passed, as when
+ * poll() reported it readable, the pop takes what is queued without
+ * waiting. Non-blocking pops ignore the mark.
+ */
+static const struct ringbuf_lowat *ringbuf_lowat_start(const struct ringbuf_lowat *lw,
+                                                       ktime_t deadline, ktime_t *until)
+{
+    ktime_t now, due;
+
+    *until = deadline;
+    if (!lw || deadline == RINGBUF_DEADLINE_NOWAIT)
+        return NULL;
+    if (lw->max_ns < 0)
+        return lw;
+
+    now = ktime_get();
+    due = lw->due ? lw->due : ktime_add_safe(now, ns_to_ktime(lw->max_ns));
+    if (!ktime_before(now, due))
+        return NULL;
+    if (ktime_before(due, deadline))
+        *until = due;
+    return lw;
+}
+
+/*
+ * PUSH_DATA and write(): push, sleeping on wq while the queue is full and
+ * faulting the source in unlocked as needed. PUSH_DATA waits until the
+ * whole message fits, write() until at least one byte does; neither waits
+ * past deadline.
+ */
+static ssize_t ringbuf_push(struct ringbuf *rb, struct iov_iter *from, bool partial,
+                            ktime_t deadline)
+{
+    size_t len, left, need;
+    ssize_t ret;
+
+    for (;;) {
+        /* re-read each time round: the mode may have changed meanwhile */
+        need = ringbuf_need(rb, iov_iter_count(from), partial);
+        if (need > READ_ONCE(rb->size))
+            return -EMSGSIZE; /* can never fit */
+
+        ret = ringbuf_push_once(rb, from, partial);
+        if (ret == -ENOSPC) {
+            /* Wait until a pop releases enough space, deadline or signal */
+            ret = ringbuf_wait_space(rb, need, deadline);
+            if (ret)
+                return ret;
+            continue;
+        }
+        if (ret != -EFAULT)
+            break;
+
+        /* source not resident: fault it in without the lock and retry */
+        len = iov_iter_count(from);
+        left = fault_in_iov_iter_readable(from, len);
+        if (partial && !ringbuf_msg_mode(rb) ? left == len : left)
+            return -EFAULT;
+    }
+
+    if (ret > 0)
+        ringbuf_wake_readers(rb, 1);
+    return ret;
+}
+
+/*
+ * POP_DATA and read(): block until data is available (reaching the low
+ * watermark lw, if any) or deadline, then pop
+ */
+static ssize_t ringbuf_pop(struct ringbuf *rb, struct iov_iter *to, ktime_t deadline,
+                           const struct ringbuf_lowat *lw)
+{
+    bool slept = false;
+    size_t len, left;
+    ktime_t until;
+    ssize_t ret;
+
+    lw = ringbuf_lowat_start(lw, deadline, &until);
+    for (;;) {
+        if (ringbuf_readable(rb, lw)) {
+            /* data available, pop straight into the caller's buffer */
+            ret = ringbuf_pop_once(rb, to);
+            if (ret == -EFAULT) {
+                /*
+                 * destination not resident: fault it in unlocked, retry.
+                 * A record is only popped whole, so it all has to be.
+                 * A pipe (splice) that took nothing is out of room or
+                 * pages; let the splice caller come back.
+                 */
+                if (!user_backed_iter(to)) {
+                    ret = -EAGAIN;
+                    break;
+                }
+                len = iov_iter_count(to);
+                left = fault_in_iov_iter_writeable(to, len);
+                if (ringbuf_msg_mode(rb) ? left : left == len)
+                    break;
+                continue;
+            }
+            if (ret != 0)
+                break;
+            /* another consumer emptied the queue first */
+        }
+
+        /* Wait until someone pushes data, deadline or signal */
+        ret = ringbuf_wait_data(rb, lw, until);
+        slept = true;
+        if (ret == -ETIMEDOUT && until != deadline) {
+            /* waited lw->max_ns for the mark: take whatever is queued */
+            lw = NULL;
+            until = deadline;
+            continue;
+        }
+        if (ret)
+            break;
+        /* loop to try again */
+    }
+
+    /* room was released: wake writers and pollers waiting for space */
+    if (ret > 0)
+        ringbuf_wake_writers(rb);
+    if (slept)
+        ringbuf_pass_wake(rb);
+    return ret;
+}
+
+/*
+ * Per-reader state: the SET_LOWAT mark of one open file in the module, and
+ * poll()'s view of the data pending below it
+ */
+
+/*
+ * lock protects everything but rb: pops, polls and SET_LOWAT on the same
+ * file may run concurrently, and each reads and updates several fields.
+ */
+struct ringbuf_reader {
+    struct ringbuf *rb;
+    spinlock_t lock;
+    struct ringbuf_lowat lowat;  /* SET_LOWAT; lowat.due is unused */
+    bool drain;                  /* popped since the mark was met: drain, then re-arm */
+    ktime_t due;                 /* poll: when data below the mark is due, 0 if none */
+    u64 pos;                     /* ctl->tail when due was set */
+    struct hrtimer timer;        /* wakes pollers at due */
+};
+
+/* forget poll()'s due time and disarm the timer (rd->lock held) */
+static void ringbuf_lowat_reset(struct ringbuf_reader *rd)
+{
+    if (!rd->due)
+        return;
+    rd->due = 0;
+    hrtimer_try_to_cancel(&rd->timer);
+}
+
+/*
+ * poll()'s due time for the data queued below rd's mark, 0 if none
+ * (rd->lock held). It was set for the bytes queued up to rd->pos: once the
+ * queue has run empty or those have all been popped, through any file or a
+ * mapping, it is stale and is reset.
+ */
+static ktime_t ringbuf_lowat_due(struct ringbuf_reader *rd)
+{
+    struct ringbuf *rb = rd->rb;
+
+    if (rd->due && ringbuf_count(rb) && (s64)(READ_ONCE(rb->ctl->head) - rd->pos) < 0)
+        return rd->due;
+    ringbuf_lowat_reset(rd);
+    return 0;
+}
+
+/*
+ * rd's low watermark in lw, or NULL if it has none or rd is draining data
+ * that already reached it (rd->lock held): the mark only applies again once
+ * the queue has run empty, so a reader taking one record per call is not
+ * held up at msgs - 1
+ */
+static const struct ringbuf_lowat *ringbuf_lowat_get(struct ringbuf_reader *rd,
+                                                     struct ringbuf_lowat *lw)
+{
+    if (rd->drain) {
+        if (ringbuf_count(rd->rb))
+            return NULL;
+        rd->drain = false;
+    }
+    *lw = rd->lowat;
+    lw->due = ringbuf_lowat_due(rd);
+    return lw->bytes || lw->msgs ? lw : NULL;
+}
+
+/* the mark a pop through rd holds out for, see ringbuf_lowat_get() */
+static const struct ringbuf_lowat *ringbuf_get_lowat(struct ringbuf_reader *rd,
+                                                     struct ringbuf_lowat *lw)
+{
+    const struct ringbuf_lowat *ret;
+
+    spin_lock(&rd->lock);
+    ret = ringbuf_lowat_get(rd, lw);
+    spin_unlock(&rd->lock);
+    return ret;
+}
+
+/*
+ * a pop through rd delivered data: drain what is left, if anything, and
+ * restart the poll() max-wait clock
+ */
+static void ringbuf_lowat_popped(struct ringbuf_reader *rd)
+{
+    spin_lock(&rd->lock);
+    rd->drain = ringbuf_count(rd->rb) != 0;
+    ringbuf_lowat_reset(rd);
+    spin_unlock(&rd->lock);
+}
+
+/*
+ * poll() readability under rd's low watermark: ringbuf_readable(), or data
+ * below the mark that has been pending for max_ns. The first poll to see
+ * such data arms rd->timer, which wakes pollers when it is due; a pop
+ * through rd, or the data going stale, disarms it.
+ */
+static bool ringbuf_poll_readable(struct ringbuf_reader *rd)
+{
+    const struct ringbuf_lowat *lw;
+    struct ringbuf_lowat buf;
+    ktime_t now;
+    bool ret;
+
+    spin_lock(&rd->lock);
+    lw = ringbuf_lowat_get(rd, &buf);
+    ret = ringbuf_readable(rd->rb, lw);
+    if (ret || !lw || lw->max_ns < 0 || !ringbuf_count(rd->rb))
+        goto out;
+
+    now = ktime_get();
+    if (!rd->due) {
+        rd->due = ktime_add_safe(now, ns_to_ktime(lw->max_ns));
+        rd->pos = READ_ONCE(rd->rb->ctl->tail);
+        hrtimer_start(&rd->timer, rd->due, HRTIMER_MODE_ABS);
+    }
+    ret = !ktime_before(now, rd->due);
+out:
+    spin_unlock(&rd->lock);
+    return ret;
+}
+
+static enum hrtimer_restart ringbuf_lowat_timer(struct hrtimer *timer)
+{
+    struct ringbuf_reader *rd = container_of(timer, struct ringbuf_reader, timer);
+
+    wake_up_interruptible_poll(&rd->rb->rq, EPOLLIN | EPOLLRDNORM);
+    return HRTIMER_NORESTART;
+}
+
+/* set up rd, zeroed, for rb; ringbuf_reader_release() before freeing it */
+static void ringbuf_reader_init(struct ringbuf_reader *rd, struct ringbuf *rb)
+{
+    rd->rb = rb;
+    spin_lock_init(&rd->lock);
+    rd->lowat.max_ns = -1;
+    hrtimer_init(&rd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    rd->timer.function = ringbuf_lowat_timer;
+}
+
+static void ringbuf_reader_release(struct ringbuf_reader *rd)
+{
+    hrtimer_cancel(&rd->timer);
+}
+
+/* SET_LOWAT: install rd's low watermark and let readers re-check it */
+static void ringbuf_reader_set_lowat(struct ringbuf_reader *rd, size_t bytes, u32 msgs,
+                                     s64 max_ns)
+{
+    spin_lock(&rd->lock);
+    rd->lowat.bytes = bytes;
+    rd->lowat.msgs = msgs;
+    rd->lowat.max_ns = max_ns < 0 ? -1 : max_ns;
+    rd->drain = false;
+    ringbuf_lowat_reset(rd);
+    spin_unlock(&rd->lock);
+
+    /* a lower mark may already be met: wake pollers and a reader to see */
+    wake_up_interruptible_poll(&rd->rb->rq, EPOLLIN | EPOLLRDNORM);
+}
+
+/* POP_DATA and read() through rd: ringbuf_pop() under rd's low watermark */
+static ssize_t ringbuf_reader_pop(struct ringbuf_reader *rd, struct iov_iter *to,
+                                  ktime_t deadline)
+{
+    struct ringbuf_lowat lw;
+    ssize_t ret;
+
+    ret = ringbuf_pop(rd->rb, to, deadline, ringbuf_get_lowat(rd, &lw));
+    if (ret > 0)
+        ringbuf_lowat_popped(rd);
+    return ret;
+}
+
+/*
+ * poll() readiness through rd: readable per ringbuf_poll_readable(),
+ * writable while any byte (in RINGBUF_MODE_MSG: a header and one byte) is
+ * free. Only the pass that registers a poller (wait) also arranges, for the
+ * events asked for, that it is woken: data_waiters for an mmap producer,
+ * and an EPOLLOUT poller is advertised like a blocked writer. Other passes
+ * only look.
+ */
+static __poll_t ringbuf_poll_mask(struct ringbuf_reader *rd, __poll_t events, bool wait)
+{
+    struct ringbuf *rb = rd->rb;
+    size_t need = ringbuf_need(rb, 1, true);
+    __poll_t mask = 0;
+
+    if (wait) {
+        if (events & (EPOLLIN | EPOLLRDNORM) && atomic_read(&rb->mmap_count))
+            WRITE_ONCE(rb->ctl->data_waiters, 1);
+        if (events & (EPOLLOUT | EPOLLWRNORM) && ringbuf_space(rb) < need)
+            ringbuf_want_space(rb, need);
+        smp_mb(); /* see ringbuf_want_space() */
+    }
+
+    if (ringbuf_poll_readable(rd))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (ringbuf_space(rb) >= need)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
+#endif /* RINGBUF_CORE_H */
@@ -0,0 +1,153 @@
+/*
+ * ringbuf_trace.h - tracepoints for /dev/ringbufdev
+ *
+ * Events appear under events/ringbuf/ in tracefs and can be used from
+ * ftrace, perf and bpftrace. They cost a static branch while disabled.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ringbuf
+
+#if !defined(_RINGBUF_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RINGBUF_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/sched.h>
+
+/*
+ * a push or pop that moved len payload bytes, with the queued bytes around
+ * it as that side saw them: the other side's position may be a cached copy
+ */
+DECLARE_EVENT_CLASS(ringbuf_xfer,
+    TP_PROTO(int id, size_t len, size_t before, size_t after),
+    TP_ARGS(id, len, before, after),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(size_t, len)
+        __field(size_t, before)
+        __field(size_t, after)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->len = len;
+        __entry->before = before;
+        __entry->after = after;
+    ),
+
+    TP_printk("queue=%d len=%zu count=%zu->%zu", __entry->id, __entry->len,
+              __entry->before, __entry->after)
+);
+
+DEFINE_EVENT(ringbuf_xfer, ringbuf_push,
+    TP_PROTO(int id, size_t len, size_t before, size_t after),
+    TP_ARGS(id, len, before, after)
+);
+
+DEFINE_EVENT(ringbuf_xfer, ringbuf_pop,
+    TP_PROTO(int id, size_t len, size_t before, size_t after),
+    TP_ARGS(id, len, before, after)
+);
+
+/* the current task is about to sleep waiting for data or for space */
+TRACE_EVENT(ringbuf_block,
+    TP_PROTO(int id, bool writer, size_t count),
+    TP_ARGS(id, writer, count),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(pid_t, pid)
+        __field(bool, writer)
+        __field(size_t, count)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->pid = current->pid;
+        __entry->writer = writer;
+        __entry->count = count;
+    ),
+
+    TP_printk("queue=%d pid=%d waits_for=%s count=%zu", __entry->id, __entry->pid,
+              __entry->writer ? "space" : "data", __entry->count)
+);
+
+/* ... and is running again: ret is 0 or the wait error, after ns blocked */
+TRACE_EVENT(ringbuf_unblock,
+    TP_PROTO(int id, bool writer, int ret, u64 ns),
+    TP_ARGS(id, writer, ret, ns),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(pid_t, pid)
+        __field(bool, writer)
+        __field(int, ret)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->pid = current->pid;
+        __entry->writer = writer;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+
+    TP_printk("queue=%d pid=%d waited_for=%s ret=%d blocked_ns=%llu", __entry->id,
+              __entry->pid, __entry->writer ? "space" : "data", __entry->ret,
+              (unsigned long long)__entry->ns)
+);
+
+/* a push woke readers (writers == false) or a pop woke writers */
+TRACE_EVENT(ringbuf_wake,
+    TP_PROTO(int id, bool writers, size_t count),
+    TP_ARGS(id, writers, count),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(bool, writers)
+        __field(size_t, count)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->writers = writers;
+        __entry->count = count;
+    ),
+
+    TP_printk("queue=%d wakes=%s count=%zu", __entry->id,
+              __entry->writers ? "writers" : "readers", __entry->count)
+);
+
+/* an ioctl on the queue returned ret */
+TRACE_EVENT(ringbuf_ioctl,
+    TP_PROTO(int id, unsigned int cmd, long ret),
+    TP_ARGS(id, cmd, ret),
+
+    TP_STRUCT__entry(
+        __field(int, id)
+        __field(pid_t, pid)
+        __field(unsigned int, cmd)
+        __field(long, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->id = id;
+        __entry->pid = current->pid;
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("queue=%d pid=%d cmd=0x%x ret=%ld", __entry->id, __entry->pid,
+              __entry->cmd, __entry->ret)
+);
+
+#endif /* _RINGBUF_TRACE_H */
+
+/* this header lives next to ringbuf.c, see CFLAGS_ringbuf.o in the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ringbuf_trace
+#include <trace/define_trace.h>
@@ -5,7 +5,7 @@
 #include "../kernel/common.h"
 
 int main(void) {
-    int fd = open("/dev/" DEVICE_NAME, O_RDWR);
+    int fd = open("/dev/" DEVICE_NAME "0", O_RDWR);
     if (fd < 0) {
         perror("open");
         return 1;
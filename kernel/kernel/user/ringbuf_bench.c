@@ -0,0 +1,345 @@
+/*
+ * ringbuf_bench.c - push/pop throughput benchmark for /dev/ringbufdev
+ *
+ * Pushes and pops fixed-size messages through the queue from a single
+ * thread and reports the resulting copy throughput per message size.
+ * Run it against two module builds to compare their data paths.
+ *
+ * With -c N it also runs a contention test: one producer and one consumer
+ * thread move N 64-byte messages, once with the default (mutex) mode and
+ * once with RINGBUF_MODE_SPSC.
+ *
+ * With -b N it compares 64-byte messages moved one per PUSH_DATA/POP_DATA
+ * call against N per PUSH_BATCH/POP_BATCH call.
+ *
+ * With -l the single-thread runs use RINGBUF_MODE_LATENCY and the queue
+ * residency histogram (GET_LATENCY_HIST) is printed after them.
+ *
+ * usage: ringbuf_bench [-d device] [-q queue_bytes] [-t seconds_per_size] [-c msgs]
+ *                      [-b batch] [-l]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include "../kernel/common.h"
+
+static const int msg_sizes[] = { 64, 4096, 65536 };
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* push/pop msg_size messages for roughly `seconds`, return bytes moved */
+static long long run_size(int fd, int msg_size, double seconds, double *elapsed)
+{
+    struct queue_data qd;
+    char *in, *out;
+    long long bytes = 0;
+    double start, t;
+    int i;
+
+    in = malloc(msg_size);
+    out = malloc(msg_size);
+    if (!in || !out) {
+        free(in);
+        free(out);
+        return -1;
+    }
+    memset(in, 0xa5, msg_size);
+
+    start = now_sec();
+    do {
+        /* check the clock every 256 messages to keep it off the hot path */
+        for (i = 0; i < 256; ++i) {
+            qd.length = msg_size;
+            qd.data = in;
+            if (ioctl(fd, PUSH_DATA, &qd) < 0) {
+                perror("ioctl PUSH_DATA");
+                goto out;
+            }
+            qd.length = msg_size;
+            qd.data = out;
+            if (ioctl(fd, POP_DATA, &qd) < 0) {
+                perror("ioctl POP_DATA");
+                goto out;
+            }
+            bytes += qd.length;
+        }
+        t = now_sec() - start;
+    } while (t < seconds);
+
+out:
+    *elapsed = now_sec() - start;
+    free(in);
+    free(out);
+    return bytes;
+}
+
+/* print and reset the residency histogram of a RINGBUF_MODE_LATENCY queue */
+static void print_latency(int fd)
+{
+    struct queue_latency ql = { .flags = RINGBUF_LAT_RESET };
+    int i;
+
+    if (ioctl(fd, GET_LATENCY_HIST, &ql) == -1) {
+        perror("ioctl GET_LATENCY_HIST");
+        return;
+    }
+
+    printf("\nqueue residency (%llu pushes unmeasured)\n", (unsigned long long)ql.unmarked);
+    printf("%14s %12s\n", "< ns", "pushes");
+    for (i = 0; i < RINGBUF_LAT_BUCKETS; ++i) {
+        if (ql.hist[i])
+            printf("%14llu %12llu\n", i < 63 ? 1ULL << i : ~0ULL,
+                   (unsigned long long)ql.hist[i]);
+    }
+}
+
+#define BATCH_MSG_SIZE 64
+
+/* push/pop `batch` messages per call for roughly `seconds`, return msgs/s */
+static double run_batch(int fd, int batch, double seconds)
+{
+    struct queue_data *ents;
+    struct queue_batch qb;
+    char *in, *out;
+    long long msgs = 0;
+    double start, t;
+    int i, n;
+
+    ents = calloc(batch, sizeof(*ents));
+    in = malloc((size_t)batch * BATCH_MSG_SIZE);
+    out = malloc((size_t)batch * BATCH_MSG_SIZE);
+    if (!ents || !in || !out) {
+        msgs = -1;
+        goto out;
+    }
+    memset(in, 0xa5, (size_t)batch * BATCH_MSG_SIZE);
+
+    start = now_sec();
+    do {
+        for (i = 0; i < 256; ++i) {
+            for (n = 0; n < batch; ++n) {
+                ents[n].length = BATCH_MSG_SIZE;
+                ents[n].data = in + (size_t)n * BATCH_MSG_SIZE;
+            }
+            qb.nr = batch;
+            qb.flags = 0;
+            qb.entries = ents;
+            n = ioctl(fd, PUSH_BATCH, &qb);
+            if (n < 0) {
+                perror("ioctl PUSH_BATCH");
+                msgs = -1;
+                goto out;
+            }
+
+            /* pop back exactly what was pushed */
+            for (qb.nr = n, n = 0; n < (int)qb.nr; ++n) {
+                ents[n].length = BATCH_MSG_SIZE;
+                ents[n].data = out + (size_t)n * BATCH_MSG_SIZE;
+            }
+            n = ioctl(fd, POP_BATCH, &qb);
+            if (n < 0) {
+                perror("ioctl POP_BATCH");
+                msgs = -1;
+                goto out;
+            }
+            msgs += n;
+        }
+        t = now_sec() - start;
+    } while (t < seconds);
+    msgs /= t;
+
+out:
+    free(ents);
+    free(in);
+    free(out);
+    return msgs;
+}
+
+#define CONTENTION_MSG_SIZE 64
+
+struct contention_arg {
+    int fd;
+    long long msgs;
+    int err;
+};
+
+/* consumer side of the contention test: pop until every message arrived */
+static void *contention_consumer(void *p)
+{
+    struct contention_arg *a = p;
+    long long want = a->msgs * CONTENTION_MSG_SIZE;
+    char buf[CONTENTION_MSG_SIZE];
+    struct queue_data qd;
+
+    while (want > 0) {
+        qd.length = sizeof(buf);
+        qd.data = buf;
+        if (ioctl(a->fd, POP_DATA, &qd) < 0) {
+            a->err = errno;
+            break;
+        }
+        want -= qd.length;
+    }
+    return NULL;
+}
+
+/* one producer thread (the caller) against one consumer thread */
+static double run_contention(int fd, int mode, long long msgs)
+{
+    struct contention_arg arg = { .fd = fd, .msgs = msgs };
+    char buf[CONTENTION_MSG_SIZE];
+    struct queue_data qd;
+    pthread_t consumer;
+    double start;
+    long long i;
+
+    if (ioctl(fd, SET_QUEUE_MODE, &mode) == -1) {
+        perror("ioctl SET_QUEUE_MODE");
+        return -1;
+    }
+
+    memset(buf, 0x5a, sizeof(buf));
+    start = now_sec();
+    if (pthread_create(&consumer, NULL, contention_consumer, &arg))
+        return -1;
+
+    for (i = 0; i < msgs; ++i) {
+        qd.length = sizeof(buf);
+        qd.data = buf;
+        /* blocks while the queue is full */
+        if (ioctl(fd, PUSH_DATA, &qd) < 0) {
+            perror("ioctl PUSH_DATA");
+            pthread_cancel(consumer);
+            pthread_join(consumer, NULL);
+            return -1;
+        }
+    }
+
+    pthread_join(consumer, NULL);
+    if (arg.err) {
+        errno = arg.err;
+        perror("ioctl POP_DATA");
+        return -1;
+    }
+    return msgs / (now_sec() - start);
+}
+
+int main(int argc, char **argv)
+{
+    __u64 queue_size = 1 << 20;
+    double seconds = 2.0;
+    long long contention_msgs = 0;
+    int batch = 0;
+    int latency = 0;
+    const char *device = "/dev/" DEVICE_NAME "0";
+    unsigned int i;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "d:q:t:c:b:l")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'q':
+            queue_size = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'c':
+            contention_msgs = atoll(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'l':
+            latency = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d device] [-q queue_bytes] [-t seconds_per_size]"
+                    " [-c msgs] [-b batch] [-l]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    if (ioctl(fd, SET_SIZE_OF_QUEUE64, &queue_size) == -1) {
+        perror("ioctl SET_SIZE_OF_QUEUE64");
+        close(fd);
+        return 1;
+    }
+
+    opt = RINGBUF_MODE_LATENCY;
+    if (latency && ioctl(fd, SET_QUEUE_MODE, &opt) == -1) {
+        perror("ioctl SET_QUEUE_MODE");
+        close(fd);
+        return 1;
+    }
+
+    printf("%10s %12s %12s %10s\n", "msg_bytes", "msgs/s", "MB/s", "seconds");
+    for (i = 0; i < sizeof(msg_sizes) / sizeof(msg_sizes[0]); ++i) {
+        double elapsed;
+        long long bytes;
+
+        if ((__u64)msg_sizes[i] > queue_size)
+            continue;
+
+        bytes = run_size(fd, msg_sizes[i], seconds, &elapsed);
+        if (bytes < 0)
+            break;
+
+        printf("%10d %12.0f %12.1f %10.2f\n", msg_sizes[i],
+               bytes / msg_sizes[i] / elapsed, bytes / elapsed / 1e6, elapsed);
+    }
+
+    if (latency)
+        print_latency(fd);
+
+    if (batch > 0) {
+        double single, batched;
+        double elapsed;
+        long long bytes;
+
+        bytes = run_size(fd, BATCH_MSG_SIZE, seconds, &elapsed);
+        single = bytes < 0 ? -1 : bytes / BATCH_MSG_SIZE / elapsed;
+        batched = run_batch(fd, batch, seconds);
+
+        printf("\n%d B messages, single vs batched\n", BATCH_MSG_SIZE);
+        printf("%10s %12.0f msgs/s\n", "single", single);
+        printf("%10s %12.0f msgs/s  (%d per call)\n", "batch", batched, batch);
+    }
+
+    if (contention_msgs > 0) {
+        double mpmc, spsc;
+
+        mpmc = run_contention(fd, 0, contention_msgs);
+        spsc = run_contention(fd, RINGBUF_MODE_SPSC, contention_msgs);
+        opt = 0;
+        ioctl(fd, SET_QUEUE_MODE, &opt); /* leave the queue in default mode */
+
+        printf("\n1 producer / 1 consumer, %d B messages\n", CONTENTION_MSG_SIZE);
+        printf("%10s %12.0f msgs/s\n", "mutex", mpmc);
+        printf("%10s %12.0f msgs/s\n", "spsc", spsc);
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,436 @@
+/*
+ * ringbuf_check.c - checks of the ring core's blocking calls
+ *
+ * First a few single-purpose checks of timeouts, a low watermark's maximum
+ * wait as seen by pops and by poll, readers with different marks sharing a
+ * queue, and what poll registers. Then, for every queue mode, one producer
+ * and one consumer thread move a known byte sequence (or, in
+ * RINGBUF_MODE_MSG, numbered records of varying length) through
+ * libringbuf's blocking push and pop, and the consumer checks that every
+ * byte arrives once and in order. Each mode is run plain, with the
+ * consumer under a low watermark, polling under a mark it cannot reach
+ * before its maximum wait, and with a third thread resizing the queue
+ * underneath. A run that hangs is killed by SIGALRM. `make check` runs it;
+ * build with SANITIZE=thread or SANITIZE=address,undefined to run it under
+ * the sanitizers.
+ *
+ * usage: ringbuf_check [-n msgs_per_run] [-t timeout_seconds]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include "../kernel/common.h"
+#include "ringbuf_lib.h"
+
+static const int modes[] = {
+    0,
+    RINGBUF_MODE_SPSC,
+    RINGBUF_MODE_MSG,
+    RINGBUF_MODE_MSG | RINGBUF_MODE_SPSC,
+    RINGBUF_MODE_MIRROR,
+    RINGBUF_MODE_MIRROR | RINGBUF_MODE_SPSC,
+    RINGBUF_MODE_MIRROR | RINGBUF_MODE_MSG,
+    RINGBUF_MODE_POW2,
+    RINGBUF_MODE_POW2 | RINGBUF_MODE_SPSC,
+    RINGBUF_MODE_POW2 | RINGBUF_MODE_MSG,
+    RINGBUF_MODE_LATENCY,
+    RINGBUF_MODE_LATENCY | RINGBUF_MODE_MSG | RINGBUF_MODE_SPSC,
+};
+
+/* longest message; fits with its record header in the smallest queue */
+#define CHECK_MAX_MSG 1500
+
+/* low watermark of the lowat runs: bytes, or records in RINGBUF_MODE_MSG */
+#define CHECK_LOWAT_BYTES 2048
+#define CHECK_LOWAT_MSGS  4
+
+/* maximum wait of the poll runs, under a mark of the whole queue */
+#define CHECK_MAX_WAIT_NS 200000
+
+enum check_kind { CHECK_PLAIN, CHECK_LOWAT, CHECK_POLL, CHECK_RESIZE };
+
+static const char *const kind_names[] = { "plain", "lowat", "poll", "resize" };
+
+struct check_run {
+    struct ringbuf *rb;
+    int mode;
+    enum check_kind kind;
+    long long msgs;
+    size_t page;          /* queue sizes are multiples of this */
+    int done;             /* consumer finished, stops the resizer */
+};
+
+static void fail(const struct check_run *r, const char *what, long long at)
+{
+    fprintf(stderr, "mode 0x%02x %s: %s at %lld\n", r->mode, kind_names[r->kind], what, at);
+    exit(1);
+}
+
+/* the byte at stream position pos; records start at nr << 20, see msg_base() */
+static unsigned char pattern(unsigned long long pos)
+{
+    return (unsigned char)(pos * 31 + (pos >> 11));
+}
+
+static size_t msg_len(long long i)
+{
+    return 1 + (size_t)(i * 7919 % CHECK_MAX_MSG);
+}
+
+static unsigned long long msg_base(const struct check_run *r, long long i, unsigned long long pos)
+{
+    return r->mode & RINGBUF_MODE_MSG ? (unsigned long long)i << 20 : pos;
+}
+
+static void *check_producer(void *p)
+{
+    struct check_run *r = p;
+    char buf[CHECK_MAX_MSG];
+    unsigned long long pos = 0, base;
+    size_t len, off, j;
+    ssize_t n;
+    long long i;
+
+    for (i = 0; i < r->msgs; ++i) {
+        len = msg_len(i);
+        base = msg_base(r, i, pos);
+        for (j = 0; j < len; ++j)
+            buf[j] = pattern(base + j);
+
+        /* odd messages go in like write(): as much as fits, then the rest */
+        for (off = 0; off < len; off += n) {
+            n = rb_lib_push_wait(r->rb, buf + off, len - off, i & 1, -1);
+            if (n <= 0)
+                fail(r, "push failed", i);
+        }
+        pos += len;
+    }
+    return NULL;
+}
+
+static void *check_resizer(void *p)
+{
+    struct check_run *r = p;
+    unsigned int k = 0;
+    int ret;
+
+    while (!__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) {
+        /* 1 to 4 pages, so that growing and shrinking both happen */
+        ret = rb_lib_resize(r->rb, (1 + k++ % 4) * r->page);
+        if (ret && ret != -ENOSPC)
+            fail(r, "resize failed", k);
+        usleep(100);
+    }
+    return NULL;
+}
+
+/* pop and check everything the producer pushes */
+static void check_consume(struct check_run *r)
+{
+    unsigned long long total = 0, pos = 0, base;
+    size_t lowat_bytes = 0, want;
+    unsigned int lowat_msgs = 0;
+    struct ringbuf_reader *rd;
+    char buf[CHECK_MAX_MSG];
+    long long i, k = 0;
+    ssize_t n, j;
+    bool msg = r->mode & RINGBUF_MODE_MSG;
+
+    for (i = 0; i < r->msgs; ++i)
+        total += msg_len(i);
+
+    rd = rb_lib_reader_create(r->rb);
+    if (!rd)
+        fail(r, "cannot create reader", 0);
+    if (r->kind == CHECK_POLL)
+        rb_lib_set_lowat(rd, SIZE_MAX, msg ? UINT32_MAX : 0, CHECK_MAX_WAIT_NS);
+
+    for (i = 0; pos < total; ++k) {
+        /* the mark never asks for more than is still to come */
+        if (r->kind == CHECK_LOWAT) {
+            size_t bytes = 0;
+            unsigned int msgs = 0;
+
+            if (msg)
+                msgs = (unsigned int)(r->msgs - i < CHECK_LOWAT_MSGS ? r->msgs - i :
+                                                                       CHECK_LOWAT_MSGS);
+            else
+                bytes = total - pos < CHECK_LOWAT_BYTES ? total - pos : CHECK_LOWAT_BYTES;
+            /* only on a change: SET_LOWAT re-arms a draining reader */
+            if (bytes != lowat_bytes || msgs != lowat_msgs) {
+                lowat_bytes = bytes;
+                lowat_msgs = msgs;
+                rb_lib_set_lowat(rd, lowat_bytes, lowat_msgs, -1);
+            }
+        }
+
+        /* once poll reports data, a pop takes it without waiting any more */
+        if (r->kind == CHECK_POLL) {
+            while (!(rb_lib_poll(rd, POLLIN, 1) & POLLIN))
+                usleep(20);
+        }
+
+        /* a whole record, or a varying read size on a byte stream */
+        want = msg ? sizeof(buf) : 1 + (size_t)(k * 104729 % sizeof(buf));
+        n = rb_lib_pop_wait(rd, buf, want, r->kind == CHECK_POLL ? 0 : -1);
+        if (n <= 0)
+            fail(r, n == -ETIMEDOUT ? "pop after POLLIN timed out" : "pop failed", i);
+        if (msg && (size_t)n != msg_len(i))
+            fail(r, "record length mismatch", i);
+
+        base = msg_base(r, i, pos);
+        for (j = 0; j < n; ++j) {
+            if ((unsigned char)buf[j] != pattern(base + j))
+                fail(r, "data mismatch", (long long)(pos + j));
+        }
+        pos += n;
+        if (msg)
+            ++i;
+    }
+
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    rb_lib_reader_destroy(rd);
+    if (rb_lib_count(r->rb))
+        fail(r, "data left over", (long long)rb_lib_count(r->rb));
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void expect(bool ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "%s: failed\n", what);
+        exit(1);
+    }
+}
+
+/* a timed call fails with -ETIMEDOUT once its time is up, and not before */
+static void check_timeouts(size_t page)
+{
+    struct ringbuf *rb = rb_lib_create(page, 0);
+    struct ringbuf_reader *rd = rb ? rb_lib_reader_create(rb) : NULL;
+    char *buf = calloc(1, page);
+    long long t;
+    ssize_t n;
+
+    expect(rb && rd && buf, "timeouts: setup");
+
+    t = now_ns();
+    n = rb_lib_pop_wait(rd, buf, 1, 2000000);
+    expect(n == -ETIMEDOUT && now_ns() - t >= 2000000, "timed pop from an empty queue");
+
+    expect(rb_lib_push(rb, buf, page, 0) == (ssize_t)page, "timeouts: fill");
+    t = now_ns();
+    n = rb_lib_push_wait(rb, buf, 1, 0, 2000000);
+    expect(n == -ETIMEDOUT && now_ns() - t >= 2000000, "timed push to a full queue");
+
+    rb_lib_reader_destroy(rd);
+    rb_lib_destroy(rb);
+    free(buf);
+    printf("timeouts ok\n");
+}
+
+/*
+ * Data below a reader's mark is taken after the mark's maximum wait: by a
+ * blocking pop, which waits that long, or once poll() has seen it pending
+ * that long, by a pop that does not wait again
+ */
+static void check_max_wait(size_t page)
+{
+    struct ringbuf *rb = rb_lib_create(2 * page, 0);
+    struct ringbuf_reader *rd = rb ? rb_lib_reader_create(rb) : NULL;
+    char buf[64] = { 0 };
+    long long t;
+    ssize_t n;
+
+    expect(rb && rd, "max wait: setup");
+
+    rb_lib_set_lowat(rd, 1000, 0, 2000000);
+    expect(rb_lib_push(rb, buf, 10, 0) == 10, "max wait: push");
+    t = now_ns();
+    n = rb_lib_pop_wait(rd, buf, sizeof(buf), -1);
+    expect(n == 10 && now_ns() - t >= 2000000, "pop below the mark after its max wait");
+
+    rb_lib_set_lowat(rd, 1000, 0, 5000000);
+    expect(rb_lib_push(rb, buf, 10, 0) == 10, "max wait: push");
+    t = now_ns();
+    expect(!(rb_lib_poll(rd, POLLIN, 1) & POLLIN), "poll below the mark");
+    while (!(rb_lib_poll(rd, POLLIN, 1) & POLLIN))
+        usleep(200);
+    expect(now_ns() - t >= 5000000, "poll readable after the max wait");
+    n = rb_lib_pop_wait(rd, buf, sizeof(buf), 0);
+    expect(n == 10, "pop after POLLIN without waiting");
+
+    /* the next data below the mark starts a new wait */
+    expect(rb_lib_push(rb, buf, 10, 0) == 10, "max wait: push");
+    expect(!(rb_lib_poll(rd, POLLIN, 1) & POLLIN), "poll below the mark after a pop");
+
+    rb_lib_reader_destroy(rd);
+    rb_lib_destroy(rb);
+    printf("max wait ok\n");
+}
+
+struct check_reader {
+    struct ringbuf_reader *rd;
+    pthread_t thread;
+    ssize_t n;
+};
+
+static void *check_reader_pop(void *p)
+{
+    struct check_reader *c = p;
+    char buf[2048];
+
+    c->n = rb_lib_pop_wait(c->rd, buf, sizeof(buf), 5000000000LL);
+    return NULL;
+}
+
+/*
+ * Blocked readers are woken one at a time; a reader still below its mark
+ * passes the wake on rather than swallowing it, so the reader behind it,
+ * which has no mark, gets the data
+ */
+static void check_reader_wake(size_t page)
+{
+    struct ringbuf *rb = rb_lib_create(2 * page, 0);
+    struct check_reader a = { 0 }, b = { 0 };
+    char buf[1000] = { 0 };
+
+    expect(rb, "reader wake: setup");
+    a.rd = rb_lib_reader_create(rb);
+    b.rd = rb_lib_reader_create(rb);
+    expect(a.rd && b.rd, "reader wake: setup");
+    rb_lib_set_lowat(a.rd, sizeof(buf), 0, -1);
+
+    /* a goes to sleep first, b behind it */
+    expect(!pthread_create(&a.thread, NULL, check_reader_pop, &a), "reader wake: thread");
+    usleep(20000);
+    expect(!pthread_create(&b.thread, NULL, check_reader_pop, &b), "reader wake: thread");
+    usleep(20000);
+
+    expect(rb_lib_push_wait(rb, buf, 10, 0, -1) == 10, "reader wake: push");
+    pthread_join(b.thread, NULL);
+    expect(b.n == 10, "wake passed over a reader below its mark");
+
+    expect(rb_lib_push_wait(rb, buf, sizeof(buf), 0, -1) == sizeof(buf), "reader wake: push");
+    pthread_join(a.thread, NULL);
+    expect(a.n == sizeof(buf), "wake of a reader at its mark");
+
+    rb_lib_reader_destroy(a.rd);
+    rb_lib_reader_destroy(b.rd);
+    rb_lib_destroy(rb);
+    printf("reader wake ok\n");
+}
+
+/*
+ * Only a registering poll for POLLOUT on a full queue counts as a blocked
+ * writer, which lets a reader below its mark take the data; other polls
+ * have no such side effect
+ */
+static void check_poll_register(size_t page)
+{
+    struct ringbuf *rb = rb_lib_create(page, RINGBUF_MODE_MSG);
+    struct ringbuf_reader *rd = rb ? rb_lib_reader_create(rb) : NULL;
+    struct ringbuf_reader *wr = rb ? rb_lib_reader_create(rb) : NULL;
+    char buf[CHECK_MAX_MSG] = { 0 };
+    size_t len = sizeof(buf);
+
+    expect(rb && rd && wr, "poll register: setup");
+    rb_lib_set_lowat(rd, 0, UINT32_MAX, -1);
+
+    /* fill the queue until not even a one-byte record fits */
+    while (len) {
+        if (rb_lib_push(rb, buf, len, 0) == -ENOSPC)
+            --len;
+    }
+    expect(!(rb_lib_poll(wr, POLLOUT, 0) & POLLOUT), "poll a full queue");
+
+    rb_lib_poll(rd, POLLIN, 1);
+    rb_lib_poll(wr, POLLIN, 1);
+    rb_lib_poll(wr, POLLOUT, 0);
+    expect(!(rb_lib_poll(rd, POLLIN, 0) & POLLIN), "poll without registering for POLLOUT");
+
+    rb_lib_poll(wr, POLLOUT, 1);
+    expect(rb_lib_poll(rd, POLLIN, 0) & POLLIN, "poll registered for POLLOUT");
+
+    rb_lib_reader_destroy(rd);
+    rb_lib_reader_destroy(wr);
+    rb_lib_destroy(rb);
+    printf("poll register ok\n");
+}
+
+static void check_run(int mode, enum check_kind kind, long long msgs, size_t page)
+{
+    struct check_run r = { .mode = mode, .kind = kind, .msgs = msgs, .page = page };
+    pthread_t producer, resizer;
+
+    r.rb = rb_lib_create(2 * page, mode);
+    if (!r.rb)
+        fail(&r, "cannot create queue", 0);
+
+    if (pthread_create(&producer, NULL, check_producer, &r))
+        fail(&r, "cannot start producer", 0);
+    if (kind == CHECK_RESIZE && pthread_create(&resizer, NULL, check_resizer, &r))
+        fail(&r, "cannot start resizer", 0);
+
+    check_consume(&r);
+
+    pthread_join(producer, NULL);
+    if (kind == CHECK_RESIZE)
+        pthread_join(resizer, NULL);
+    rb_lib_destroy(r.rb);
+    printf("mode 0x%02x %-6s ok\n", mode, kind_names[kind]);
+}
+
+int main(int argc, char **argv)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    unsigned int timeout = 60;
+    long long msgs = 20000;
+    unsigned int i;
+    int kind;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            msgs = strtoll(optarg, NULL, 0);
+            break;
+        case 't':
+            timeout = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n msgs_per_run] [-t timeout_seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    alarm(timeout);
+    check_timeouts(page);
+    check_max_wait(page);
+    check_reader_wake(page);
+    check_poll_register(page);
+
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+        for (kind = CHECK_PLAIN; kind <= CHECK_RESIZE; ++kind) {
+            alarm(timeout);
+            check_run(modes[i], kind, msgs, page);
+        }
+    }
+    alarm(0);
+    return 0;
+}
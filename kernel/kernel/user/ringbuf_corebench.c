@@ -0,0 +1,167 @@
+/*
+ * ringbuf_corebench.c - push/pop throughput of the ring core, no module
+ *
+ * Runs the module's data path through ringbuf_lib: first push/pop pairs
+ * from one thread per message size, like ringbuf_bench, then one producer
+ * and one consumer thread spinning on a shared queue. Useful under perf,
+ * valgrind and the sanitizers (make SANITIZE=address,undefined or
+ * SANITIZE=thread).
+ *
+ * usage: ringbuf_corebench [-q queue_bytes] [-t seconds_per_run] [-m mode]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../kernel/common.h"
+#include "ringbuf_lib.h"
+
+static const int msg_sizes[] = { 64, 4096, 65536 };
+
+#define SPSC_MSG_SIZE 64
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* push/pop msg_size messages for roughly `seconds`, return msgs/s */
+static double run_size(struct ringbuf *rb, int msg_size, double seconds)
+{
+    long long msgs = 0;
+    double start, t;
+    char *in, *out;
+    int i;
+
+    in = malloc(msg_size);
+    out = malloc(msg_size);
+    if (!in || !out) {
+        free(in);
+        free(out);
+        return -1;
+    }
+    memset(in, 0xa5, msg_size);
+
+    start = now_sec();
+    do {
+        for (i = 0; i < 1024; ++i) {
+            if (rb_lib_push(rb, in, msg_size, 0) != msg_size ||
+                rb_lib_pop(rb, out, msg_size) != msg_size) {
+                fprintf(stderr, "push/pop of %d bytes failed\n", msg_size);
+                msgs = -1;
+                goto out;
+            }
+        }
+        msgs += i;
+        t = now_sec() - start;
+    } while (t < seconds);
+
+out:
+    free(in);
+    free(out);
+    return msgs < 0 ? -1 : msgs / t;
+}
+
+struct spsc_arg {
+    struct ringbuf *rb;
+    long long msgs;
+};
+
+static void *spsc_consumer(void *p)
+{
+    struct spsc_arg *a = p;
+    char buf[SPSC_MSG_SIZE];
+    long long got = 0;
+    ssize_t n;
+
+    while (got < a->msgs) {
+        n = rb_lib_pop(a->rb, buf, sizeof(buf));
+        if (n > 0)
+            got += n / SPSC_MSG_SIZE;
+        else
+            sched_yield(); /* empty */
+    }
+    return NULL;
+}
+
+/* one producer (the caller) and one consumer thread, returns msgs/s */
+static double run_spsc(struct ringbuf *rb, long long msgs)
+{
+    struct spsc_arg arg = { .rb = rb, .msgs = msgs };
+    char buf[SPSC_MSG_SIZE];
+    pthread_t consumer;
+    double start;
+    long long i;
+
+    memset(buf, 0x5a, sizeof(buf));
+    start = now_sec();
+    if (pthread_create(&consumer, NULL, spsc_consumer, &arg))
+        return -1;
+    for (i = 0; i < msgs; ++i) {
+        while (rb_lib_push(rb, buf, sizeof(buf), 0) < 0)
+            sched_yield(); /* full */
+    }
+    pthread_join(consumer, NULL);
+    return msgs / (now_sec() - start);
+}
+
+int main(int argc, char **argv)
+{
+    size_t queue_size = 1 << 20;
+    double seconds = 1.0, rate;
+    struct ringbuf *rb;
+    unsigned int i;
+    int mode = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "q:t:m:")) != -1) {
+        switch (opt) {
+        case 'q':
+            queue_size = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'm':
+            mode = (int)strtol(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-q queue_bytes] [-t seconds_per_run] [-m mode]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    rb = rb_lib_create(queue_size, mode);
+    if (!rb) {
+        fprintf(stderr, "cannot create a %zu byte queue in mode %#x\n", queue_size, mode);
+        return 1;
+    }
+
+    printf("%10s %12s %12s\n", "msg_bytes", "msgs/s", "MB/s");
+    for (i = 0; i < sizeof(msg_sizes) / sizeof(msg_sizes[0]); ++i) {
+        if ((size_t)msg_sizes[i] + RINGBUF_MSG_HDR_LEN > queue_size)
+            continue;
+        rate = run_size(rb, msg_sizes[i], seconds);
+        if (rate < 0)
+            break;
+        printf("%10d %12.0f %12.1f\n", msg_sizes[i], rate, rate * msg_sizes[i] / 1e6);
+    }
+
+    /* size the SPSC run from the single-thread rate so it takes ~seconds */
+    rate = run_size(rb, SPSC_MSG_SIZE, seconds / 10);
+    if (rate > 0) {
+        rate = run_spsc(rb, (long long)(rate * seconds / 2));
+        printf("\n1 producer / 1 consumer, %d B messages: %.0f msgs/s\n", SPSC_MSG_SIZE, rate);
+    }
+
+    rb_lib_destroy(rb);
+    return 0;
+}
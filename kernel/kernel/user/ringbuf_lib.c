@@ -0,0 +1,226 @@
+/*
+ * ringbuf_lib.c - userspace build of the ring core, see ringbuf_lib.h
+ *
+ * ringbuf_core.h is compiled here against ringbuf_shim.h; this file adds
+ * what the module does around it: buffer allocation and the locking
+ * sequence of SET_SIZE_OF_QUEUE and SET_QUEUE_MODE. Blocking pushes and
+ * pops, low watermarks and poll readiness are the core's own code.
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <unistd.h>
+#include "ringbuf_shim.h"
+
+/*
+ * Mirrored rings are a memfd mapped twice back to back, the userspace
+ * equivalent of ringbuf_alloc()'s double vmap(). Their pages pointer is
+ * this marker, which is all ringbuf_core.h looks at.
+ */
+static struct page *rb_lib_mirrored[1];
+
+static char *ringbuf_alloc(size_t sz, bool mirror, struct page ***pagesp)
+{
+    char *buf;
+    int fd;
+
+    *pagesp = NULL;
+    if (!mirror)
+        return calloc(1, sz);
+
+    fd = memfd_create("ringbuf", 0);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, (off_t)sz))
+        goto err_fd;
+
+    /* reserve both halves, then map the same file over each */
+    buf = mmap(NULL, 2 * sz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        goto err_fd;
+    if (mmap(buf, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(buf + sz, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(buf, 2 * sz);
+        goto err_fd;
+    }
+
+    close(fd);
+    *pagesp = rb_lib_mirrored;
+    return buf;
+
+err_fd:
+    close(fd);
+    return NULL;
+}
+
+static void ringbuf_free_buf(char *buf, struct page **pages, size_t sz)
+{
+    if (pages)
+        munmap(buf, 2 * sz);
+    else
+        free(buf);
+}
+
+#include "../ringbuf_core.h"
+#include "ringbuf_lib.h"
+
+struct ringbuf *rb_lib_create(size_t size, int mode)
+{
+    struct ringbuf *rb;
+
+    /* struct ringbuf is cache-line aligned, see ringbuf_core.h */
+    rb = aligned_alloc(_Alignof(struct ringbuf), sizeof(*rb));
+    if (!rb)
+        return NULL;
+    memset(rb, 0, sizeof(*rb));
+
+    pthread_mutex_init(&rb->lock.m, NULL);
+    pthread_rwlock_init(&rb->srcu.rw, NULL);
+    init_waitqueue_head(&rb->wq);
+    init_waitqueue_head(&rb->rq);
+    rb->wr_need = SIZE_MAX;
+    rb->stats = calloc(1, sizeof(*rb->stats));
+    rb->ctl = calloc(1, sizeof(*rb->ctl));
+    if (!rb->stats || !rb->ctl || rb_lib_set_mode(rb, mode) || rb_lib_resize(rb, size)) {
+        rb_lib_destroy(rb);
+        return NULL;
+    }
+    return rb;
+}
+
+void rb_lib_destroy(struct ringbuf *rb)
+{
+    if (rb->ctl)
+        ringbuf_free(rb);
+    kvfree(rb->marks);
+    free(rb->stats);
+    free(rb->ctl);
+    destroy_waitqueue_head(&rb->rq);
+    destroy_waitqueue_head(&rb->wq);
+    pthread_rwlock_destroy(&rb->srcu.rw);
+    pthread_mutex_destroy(&rb->lock.m);
+    free(rb);
+}
+
+int rb_lib_resize(struct ringbuf *rb, size_t size)
+{
+    struct page **npages;
+    char *nbuf;
+    int mode, ret;
+
+    mode = READ_ONCE(rb->mode);
+    size = ringbuf_round_size(mode, size);
+    if (!size || size > RINGBUF_MAX_SIZE)
+        return -EINVAL;
+    if (mode & RINGBUF_MODE_MIRROR && size % (size_t)sysconf(_SC_PAGESIZE))
+        return -EINVAL;
+
+    nbuf = ringbuf_alloc(size, mode & RINGBUF_MODE_MIRROR, &npages);
+    if (!nbuf)
+        return -ENOMEM;
+
+    mutex_lock(&rb->lock);
+    mode = ringbuf_quiesce(rb);
+    ret = ringbuf_resize(rb, nbuf, npages, size);
+    ringbuf_resume(rb, mode);
+    mutex_unlock(&rb->lock);
+    if (ret) {
+        ringbuf_free_buf(nbuf, npages, size);
+        return ret;
+    }
+
+    /* every blocked writer re-checks its need against the new size */
+    WRITE_ONCE(rb->wr_need, SIZE_MAX);
+    wake_up_interruptible_poll(&rb->wq, EPOLLOUT | EPOLLWRNORM);
+    ringbuf_stat_add(rb, wakeups, 1);
+    return 0;
+}
+
+int rb_lib_set_mode(struct ringbuf *rb, int mode)
+{
+    int old, ret;
+
+    if (mode & ~RINGBUF_MODE_MASK)
+        return -EINVAL;
+
+    mutex_lock(&rb->lock);
+    old = ringbuf_quiesce(rb);
+    ret = ringbuf_set_mode(rb, old, mode);
+    ringbuf_resume(rb, ret ? old : mode);
+    mutex_unlock(&rb->lock);
+    return ret;
+}
+
+ssize_t rb_lib_push(struct ringbuf *rb, const void *buf, size_t len, int partial)
+{
+    struct iov_iter iter;
+
+    if (!len)
+        return -EINVAL;
+    iov_iter_init_buf(&iter, (void *)buf, len);
+    return ringbuf_push_once(rb, &iter, partial);
+}
+
+ssize_t rb_lib_pop(struct ringbuf *rb, void *buf, size_t len)
+{
+    struct iov_iter iter;
+
+    if (!len)
+        return -EINVAL;
+    iov_iter_init_buf(&iter, buf, len);
+    return ringbuf_pop_once(rb, &iter);
+}
+
+ssize_t rb_lib_push_wait(struct ringbuf *rb, const void *buf, size_t len, int partial,
+                         long long timeout_ns)
+{
+    struct iov_iter iter;
+
+    if (!len)
+        return -EINVAL;
+    iov_iter_init_buf(&iter, (void *)buf, len);
+    return ringbuf_push(rb, &iter, partial, ringbuf_deadline_after(timeout_ns));
+}
+
+struct ringbuf_reader *rb_lib_reader_create(struct ringbuf *rb)
+{
+    struct ringbuf_reader *rd;
+
+    rd = calloc(1, sizeof(*rd));
+    if (rd)
+        ringbuf_reader_init(rd, rb);
+    return rd;
+}
+
+void rb_lib_reader_destroy(struct ringbuf_reader *rd)
+{
+    ringbuf_reader_release(rd);
+    pthread_mutex_destroy(&rd->lock);
+    free(rd);
+}
+
+void rb_lib_set_lowat(struct ringbuf_reader *rd, size_t bytes, unsigned int msgs,
+                      long long max_wait_ns)
+{
+    ringbuf_reader_set_lowat(rd, min_t(size_t, bytes, RINGBUF_MAX_SIZE), msgs, max_wait_ns);
+}
+
+ssize_t rb_lib_pop_wait(struct ringbuf_reader *rd, void *buf, size_t len, long long timeout_ns)
+{
+    struct iov_iter iter;
+
+    if (!len)
+        return -EINVAL;
+    iov_iter_init_buf(&iter, buf, len);
+    return ringbuf_reader_pop(rd, &iter, ringbuf_deadline_after(timeout_ns));
+}
+
+unsigned int rb_lib_poll(struct ringbuf_reader *rd, unsigned int events, int wait)
+{
+    return ringbuf_poll_mask(rd, events, wait);
+}
+
+size_t rb_lib_count(struct ringbuf *rb)
+{
+    return ringbuf_count(rb);
+}
@@ -0,0 +1,72 @@
+/*
+ * ringbuf_lib.h - the module's ring core as a userspace library
+ *
+ * Same algorithms and modes as /dev/ringbufdev (RINGBUF_MODE_* from
+ * common.h), built from ringbuf_core.h by ringbuf_lib.c, so the data path
+ * can be benchmarked, profiled and run under sanitizers without loading
+ * the module. rb_lib_push() and rb_lib_pop() never block: a push that
+ * does not fit returns -ENOSPC and a pop from an empty queue returns 0.
+ * rb_lib_push_wait() and rb_lib_pop_wait() are the module's blocking
+ * calls, timeouts and low watermarks included. Errors are negative errno
+ * values, as in the kernel.
+ */
+
+#ifndef RINGBUF_LIB_H
+#define RINGBUF_LIB_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct ringbuf;
+struct ringbuf_reader;
+
+/* a queue of size bytes in mode (RINGBUF_MODE_* bits), NULL on failure */
+struct ringbuf *rb_lib_create(size_t size, int mode);
+void rb_lib_destroy(struct ringbuf *rb);
+
+/* SET_SIZE_OF_QUEUE: resize, keeping the queued data (RINGBUF_MODE_POW2 rounds up) */
+int rb_lib_resize(struct ringbuf *rb, size_t size);
+
+/* SET_QUEUE_MODE */
+int rb_lib_set_mode(struct ringbuf *rb, int mode);
+
+/* PUSH_DATA (partial == 0) or write() (partial != 0); bytes pushed */
+ssize_t rb_lib_push(struct ringbuf *rb, const void *buf, size_t len, int partial);
+
+/* POP_DATA/read(); bytes popped, 0 if the queue is empty */
+ssize_t rb_lib_pop(struct ringbuf *rb, void *buf, size_t len);
+
+/*
+ * blocking PUSH_DATA (partial == 0) or write(): wait while too little is
+ * free, for at most timeout_ns (< 0: no limit; -ETIMEDOUT once it is up).
+ * -EMSGSIZE if it can never fit.
+ */
+ssize_t rb_lib_push_wait(struct ringbuf *rb, const void *buf, size_t len, int partial,
+                         long long timeout_ns);
+
+/*
+ * A consumer's low watermark and poll state, the module's per-open-file
+ * SET_LOWAT state. Any number may share a queue.
+ */
+struct ringbuf_reader *rb_lib_reader_create(struct ringbuf *rb);
+void rb_lib_reader_destroy(struct ringbuf_reader *rd);
+
+/* SET_LOWAT: max_wait_ns < 0 waits for the mark indefinitely */
+void rb_lib_set_lowat(struct ringbuf_reader *rd, size_t bytes, unsigned int msgs,
+                      long long max_wait_ns);
+
+/* blocking POP_DATA/read() under rd's low watermark, timeout as for rb_lib_push_wait() */
+ssize_t rb_lib_pop_wait(struct ringbuf_reader *rd, void *buf, size_t len, long long timeout_ns);
+
+/*
+ * poll(): POLLIN/POLLOUT (with POLLRDNORM/POLLWRNORM) readiness through
+ * rd. wait != 0 is the pass of a poll() that is about to sleep, which
+ * registers for the events asked for; libringbuf pollers never sleep, so
+ * poll again to see a low watermark's max wait run out.
+ */
+unsigned int rb_lib_poll(struct ringbuf_reader *rd, unsigned int events, int wait);
+
+/* bytes queued */
+size_t rb_lib_count(struct ringbuf *rb);
+
+#endif /* RINGBUF_LIB_H */
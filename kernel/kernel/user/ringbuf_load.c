@@ -0,0 +1,377 @@
+/*
+ * ringbuf_load.c - multi-threaded load generator for /dev/ringbufdev
+ *
+ * Runs P producer and C consumer threads against one queue for a fixed
+ * time. Every message carries its CLOCK_MONOTONIC send time in its first
+ * 8 bytes, so consumers measure end-to-end latency (push call to pop
+ * return) into a log-linear histogram. Prints one result row as CSV or
+ * JSON, so runs against different module builds can be collected and
+ * compared.
+ *
+ * usage: ringbuf_load [-d device] [-p producers] [-c consumers] [-s msg_bytes]
+ *                     [-q queue_bytes] [-t seconds] [-m mode] [-C cpu,cpu,...]
+ *                     [-f csv|json] [-H] [-L lowat_bytes] [-W max_wait_us]
+ *
+ * -m takes RINGBUF_MODE_* bits for SET_QUEUE_MODE. -C pins producers and
+ * then consumers to the listed CPUs, round robin. -H leaves out the CSV
+ * header line, for appending to an existing file. -L sets a SET_LOWAT
+ * byte mark for the consumers, delivered after at most -W microseconds
+ * (default 1000) so that the tail of the run still drains.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include "../kernel/common.h"
+
+#define MAX_THREADS 256
+#define MAX_CPUS    1024
+
+/* poll interval for the stop flag while a push or pop is blocked */
+#define STOP_POLL_NS 100000000LL
+
+/*
+ * Latency histogram: values below 16 ns get a bucket each, above that
+ * every power of two is split into 16 linear sub-buckets (~6% error).
+ */
+#define HIST_SUB     16
+#define HIST_BUCKETS 1024
+
+struct hist {
+    uint64_t n[HIST_BUCKETS];
+};
+
+static unsigned int hist_idx(uint64_t v)
+{
+    unsigned int e;
+
+    if (v < HIST_SUB)
+        return (unsigned int)v;
+    e = 63 - __builtin_clzll(v); /* >= 4 */
+    return (e - 3) * HIST_SUB + (unsigned int)((v >> (e - 4)) & (HIST_SUB - 1));
+}
+
+/* largest value that falls into bucket i */
+static uint64_t hist_value(unsigned int i)
+{
+    unsigned int e;
+
+    if (i < HIST_SUB)
+        return i;
+    e = i / HIST_SUB + 3;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << (e - 4)) - 1;
+}
+
+static uint64_t hist_percentile(const struct hist *h, uint64_t total, double pct)
+{
+    uint64_t want = (uint64_t)(total * pct / 100.0);
+    uint64_t seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->n[i];
+        if (seen > want)
+            return hist_value(i);
+    }
+    return 0;
+}
+
+struct worker {
+    pthread_t tid;
+    int fd;
+    int cpu;              /* -1: not pinned */
+    long long msgs;       /* messages moved */
+    uint64_t max_ns;      /* consumers: worst latency seen */
+    struct hist hist;     /* consumers: latency distribution */
+    int err;
+};
+
+static int msg_size = 64;
+static volatile int producers_stop;
+static volatile int consumers_stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pin(struct worker *w)
+{
+    cpu_set_t set;
+
+    if (w->cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *producer(void *p)
+{
+    struct worker *w = p;
+    struct queue_data_timed qd;
+    char *buf;
+    uint64_t ts;
+
+    pin(w);
+    buf = calloc(1, msg_size);
+    if (!buf) {
+        w->err = ENOMEM;
+        return NULL;
+    }
+
+    while (!producers_stop) {
+        ts = now_ns();
+        memcpy(buf, &ts, sizeof(ts));
+        qd.length = msg_size;
+        qd.data = buf;
+        qd.timeout_ns = STOP_POLL_NS;
+        if (ioctl(w->fd, PUSH_DATA_TIMED, &qd) < 0) {
+            if (errno == ETIMEDOUT || errno == EINTR)
+                continue; /* queue full: re-check the stop flag */
+            w->err = errno;
+            break;
+        }
+        w->msgs++;
+    }
+    free(buf);
+    return NULL;
+}
+
+static void *consumer(void *p)
+{
+    struct worker *w = p;
+    struct queue_data_timed qd;
+    uint64_t ts, lat;
+    char *buf;
+
+    pin(w);
+    buf = malloc(msg_size);
+    if (!buf) {
+        w->err = ENOMEM;
+        return NULL;
+    }
+
+    for (;;) {
+        qd.length = msg_size;
+        qd.data = buf;
+        qd.timeout_ns = STOP_POLL_NS;
+        if (ioctl(w->fd, POP_DATA_TIMED, &qd) < 0) {
+            if (errno == ETIMEDOUT && consumers_stop)
+                break; /* producers are done and the queue is drained */
+            if (errno == ETIMEDOUT || errno == EINTR)
+                continue;
+            w->err = errno;
+            break;
+        }
+        if (qd.length != msg_size) {
+            w->err = EPROTO; /* fixed-size pushes must pop whole */
+            break;
+        }
+
+        memcpy(&ts, buf, sizeof(ts));
+        lat = now_ns() - ts;
+        w->hist.n[hist_idx(lat)]++;
+        if (lat > w->max_ns)
+            w->max_ns = lat;
+        w->msgs++;
+    }
+    free(buf);
+    return NULL;
+}
+
+/* parse "0,2,4" into cpus[], returns the count */
+static int parse_cpus(char *list, int *cpus)
+{
+    char *tok, *save = NULL;
+    int n = 0;
+
+    for (tok = strtok_r(list, ",", &save); tok && n < MAX_CPUS;
+         tok = strtok_r(NULL, ",", &save))
+        cpus[n++] = atoi(tok);
+    return n;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d device] [-p producers] [-c consumers] [-s msg_bytes]\n"
+            "       [-q queue_bytes] [-t seconds] [-m mode] [-C cpu,cpu,...]"
+            " [-f csv|json] [-H]\n"
+            "       [-L lowat_bytes] [-W max_wait_us]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = "/dev/" DEVICE_NAME "0";
+    const char *format = "csv";
+    static struct worker workers[2 * MAX_THREADS];
+    static struct hist total;
+    static int cpus[MAX_CPUS];
+    int nr_prod = 1, nr_cons = 1, nr_cpus = 0;
+    __u64 queue_size = 1 << 20;
+    double seconds = 5.0, elapsed;
+    long long pushed = 0, popped = 0;
+    uint64_t start, max_ns = 0;
+    struct queue_lowat lowat = { .max_wait_ns = 1000000 };
+    int mode = 0, header = 1;
+    int opt, fd, i, j, n, err = 0;
+
+    while ((opt = getopt(argc, argv, "d:p:c:s:q:t:m:C:f:HL:W:")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'p':
+            nr_prod = atoi(optarg);
+            break;
+        case 'c':
+            nr_cons = atoi(optarg);
+            break;
+        case 's':
+            msg_size = atoi(optarg);
+            break;
+        case 'q':
+            queue_size = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'm':
+            mode = (int)strtol(optarg, NULL, 0);
+            break;
+        case 'C':
+            nr_cpus = parse_cpus(optarg, cpus);
+            break;
+        case 'f':
+            format = optarg;
+            break;
+        case 'H':
+            header = 0;
+            break;
+        case 'L':
+            lowat.bytes = strtoull(optarg, NULL, 0);
+            break;
+        case 'W':
+            lowat.max_wait_ns = (__s64)(atof(optarg) * 1000);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (nr_prod < 1 || nr_prod > MAX_THREADS || nr_cons < 1 || nr_cons > MAX_THREADS ||
+        msg_size < (int)sizeof(uint64_t) || (__u64)msg_size > queue_size ||
+        (strcmp(format, "csv") && strcmp(format, "json"))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    if (ioctl(fd, SET_SIZE_OF_QUEUE64, &queue_size) == -1) {
+        perror("ioctl SET_SIZE_OF_QUEUE64");
+        close(fd);
+        return 1;
+    }
+    if (ioctl(fd, SET_QUEUE_MODE, &mode) == -1) {
+        perror("ioctl SET_QUEUE_MODE");
+        close(fd);
+        return 1;
+    }
+    if (lowat.bytes && ioctl(fd, SET_LOWAT, &lowat) == -1) {
+        perror("ioctl SET_LOWAT");
+        close(fd);
+        return 1;
+    }
+
+    /* producers first, then consumers, each pinned round robin if asked */
+    n = nr_prod + nr_cons;
+    for (i = 0; i < n; ++i) {
+        workers[i].fd = fd;
+        workers[i].cpu = nr_cpus ? cpus[i % nr_cpus] : -1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < n; ++i) {
+        if (pthread_create(&workers[i].tid, NULL, i < nr_prod ? producer : consumer,
+                           &workers[i])) {
+            fprintf(stderr, "pthread_create failed\n");
+            producers_stop = consumers_stop = 1;
+            for (j = 0; j < i; ++j)
+                pthread_join(workers[j].tid, NULL);
+            close(fd);
+            return 1;
+        }
+    }
+
+    usleep((useconds_t)(seconds * 1e6));
+    producers_stop = 1;
+    for (i = 0; i < nr_prod; ++i)
+        pthread_join(workers[i].tid, NULL);
+    consumers_stop = 1;
+    for (i = nr_prod; i < n; ++i)
+        pthread_join(workers[i].tid, NULL);
+    elapsed = (now_ns() - start) / 1e9;
+
+    for (i = 0; i < n; ++i) {
+        if (workers[i].err) {
+            fprintf(stderr, "%s %d: %s\n", i < nr_prod ? "producer" : "consumer",
+                    i < nr_prod ? i : i - nr_prod, strerror(workers[i].err));
+            err = 1;
+        }
+        if (i < nr_prod) {
+            pushed += workers[i].msgs;
+            continue;
+        }
+        popped += workers[i].msgs;
+        if (workers[i].max_ns > max_ns)
+            max_ns = workers[i].max_ns;
+        for (j = 0; j < HIST_BUCKETS; ++j)
+            total.n[j] += workers[i].hist.n[j];
+    }
+    if (pushed != popped)
+        fprintf(stderr, "warning: %lld pushed but %lld popped\n", pushed, popped);
+
+    if (!strcmp(format, "json")) {
+        printf("{\"producers\": %d, \"consumers\": %d, \"msg_bytes\": %d, "
+               "\"queue_bytes\": %llu, \"mode\": %d, \"seconds\": %.3f, "
+               "\"msgs_per_s\": %.0f, \"gb_per_s\": %.3f, \"p50_ns\": %llu, "
+               "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}\n",
+               nr_prod, nr_cons, msg_size, (unsigned long long)queue_size, mode, elapsed,
+               popped / elapsed, popped * (double)msg_size / elapsed / 1e9,
+               (unsigned long long)hist_percentile(&total, popped, 50.0),
+               (unsigned long long)hist_percentile(&total, popped, 99.0),
+               (unsigned long long)hist_percentile(&total, popped, 99.9),
+               (unsigned long long)max_ns);
+    } else {
+        if (header)
+            printf("producers,consumers,msg_bytes,queue_bytes,mode,seconds,msgs_per_s,"
+                   "gb_per_s,p50_ns,p99_ns,p999_ns,max_ns\n");
+        printf("%d,%d,%d,%llu,%d,%.3f,%.0f,%.3f,%llu,%llu,%llu,%llu\n",
+               nr_prod, nr_cons, msg_size, (unsigned long long)queue_size, mode, elapsed,
+               popped / elapsed, popped * (double)msg_size / elapsed / 1e9,
+               (unsigned long long)hist_percentile(&total, popped, 50.0),
+               (unsigned long long)hist_percentile(&total, popped, 99.0),
+               (unsigned long long)hist_percentile(&total, popped, 99.9),
+               (unsigned long long)max_ns);
+    }
+
+    close(fd);
+    return err;
+}
@@ -0,0 +1,152 @@
+/*
+ * ringbuf_mmap.h - userspace side of the mmap()ed ring
+ *
+ * Implements the protocol described at struct ringbuf_ctl in common.h.
+ * These helpers take no locks: a ring may have at most one producer
+ * (mmap or ioctl) and one consumer at a time. They move raw bytes; on a
+ * RINGBUF_MODE_MSG queue push and pop whole records framed as described in
+ * common.h.
+ */
+
+#ifndef RINGBUF_MMAP_H
+#define RINGBUF_MMAP_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "../kernel/common.h"
+
+struct rb_map {
+    int fd;
+    struct ringbuf_ctl *ctl;
+    char *data;
+    size_t size;
+    size_t map_len;
+    int mirror; /* data is mapped twice: no copy wraps */
+    size_t mask; /* size - 1 for power-of-two sizes, else 0 */
+    uint64_t head_cache; /* producer's last view of ctl->head */
+    uint64_t tail_cache; /* consumer's last view of ctl->tail */
+};
+
+/* data offset of a free-running position */
+static inline size_t rb_map_off(const struct rb_map *m, uint64_t pos)
+{
+    return m->mask ? (size_t)(pos & m->mask) : (size_t)(pos % m->size);
+}
+
+/* map the ctl page and data area of an already sized queue */
+static inline int rb_map_open(struct rb_map *m, int fd)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    struct ringbuf_ctl *ctl;
+    void *p;
+
+    /* map the ctl page alone first to learn the data area size */
+    ctl = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ctl == MAP_FAILED)
+        return -errno;
+    m->size = ctl->size;
+    m->mirror = !!(ctl->flags & RINGBUF_CTL_MIRROR);
+    m->mask = m->size > 1 && !(m->size & (m->size - 1)) ? m->size - 1 : 0;
+    munmap(ctl, page);
+    if (!m->size)
+        return -EINVAL;
+
+    if (m->mirror)
+        m->map_len = page + 2 * m->size;
+    else
+        m->map_len = page + (m->size + page - 1) / page * page;
+    p = mmap(NULL, m->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return -errno;
+
+    m->fd = fd;
+    m->ctl = p;
+    m->data = (char *)p + page;
+    m->head_cache = __atomic_load_n(&m->ctl->head, __ATOMIC_ACQUIRE);
+    m->tail_cache = __atomic_load_n(&m->ctl->tail, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+static inline void rb_map_close(struct rb_map *m)
+{
+    munmap(m->ctl, m->map_len);
+    m->ctl = NULL;
+    m->data = NULL;
+}
+
+/* wake the kernel side if it sleeps on `waiters` (after moving head/tail) */
+static inline void rb_map_notify(struct rb_map *m, uint32_t *waiters)
+{
+    /* pairs with the barrier in ringbuf_data_ready()/ringbuf_space_ready() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_RELAXED))
+        ioctl(m->fd, NOTIFY_QUEUE);
+}
+
+/*
+ * push len bytes, all or nothing; returns 0 or -ENOSPC
+ *
+ * ctl->head is only loaded when the cached copy shows too little room, so
+ * a producer that is not running into the consumer leaves its line alone.
+ */
+static inline int rb_map_push(struct rb_map *m, const void *src, size_t len)
+{
+    uint64_t tail = m->ctl->tail; /* owned by this producer */
+    uint64_t head = m->head_cache;
+    size_t off, first;
+
+    if (tail - head > m->size || len > m->size - (size_t)(tail - head)) {
+        head = __atomic_load_n(&m->ctl->head, __ATOMIC_ACQUIRE);
+        m->head_cache = head;
+        if (len > m->size - (size_t)(tail - head))
+            return -ENOSPC;
+    }
+
+    off = rb_map_off(m, tail);
+    first = m->mirror || len < m->size - off ? len : m->size - off;
+    memcpy(m->data + off, src, first);
+    memcpy(m->data, (const char *)src + first, len - first);
+
+    __atomic_store_n(&m->ctl->tail, tail + len, __ATOMIC_RELEASE);
+    rb_map_notify(m, &m->ctl->data_waiters);
+    return 0;
+}
+
+/* pop up to len bytes; returns the number of bytes copied (0 if empty) */
+static inline size_t rb_map_pop(struct rb_map *m, void *dst, size_t len)
+{
+    uint64_t head = m->ctl->head; /* owned by this consumer */
+    uint64_t tail = m->tail_cache;
+    size_t off, first;
+
+    /* as in rb_map_push(): reload ctl->tail only when the copy falls short */
+    if (tail - head > m->size || len > (size_t)(tail - head)) {
+        tail = __atomic_load_n(&m->ctl->tail, __ATOMIC_ACQUIRE);
+        m->tail_cache = tail;
+    }
+    if (len > (size_t)(tail - head))
+        len = (size_t)(tail - head);
+    if (!len)
+        return 0;
+
+    off = rb_map_off(m, head);
+    first = m->mirror || len < m->size - off ? len : m->size - off;
+    memcpy(dst, m->data + off, first);
+    memcpy((char *)dst + first, m->data, len - first);
+
+    __atomic_store_n(&m->ctl->head, head + len, __ATOMIC_RELEASE);
+    rb_map_notify(m, &m->ctl->space_waiters);
+    return len;
+}
+
+/* sleep in the kernel until RINGBUF_WAIT_DATA or RINGBUF_WAIT_SPACE holds */
+static inline int rb_map_wait(struct rb_map *m, int what)
+{
+    return ioctl(m->fd, WAIT_QUEUE, &what) < 0 ? -errno : 0;
+}
+
+#endif /* RINGBUF_MMAP_H */
@@ -0,0 +1,501 @@
+/*
+ * ringbuf_shim.h - the kernel APIs ringbuf_core.h needs, for userspace
+ *
+ * Just enough to compile the ring core as an ordinary C library: mutexes
+ * are pthread mutexes, SRCU is a pthread rwlock (read side around lockless
+ * SPSC push/pop, write side in synchronize_srcu()), per-CPU counters are a
+ * single copy and iov_iter is a plain buffer cursor. Memory ordering
+ * helpers map to the __atomic builtins so that TSan understands them.
+ * Wait queues work like the kernel's: a list of entries with wake
+ * functions, exclusive waiters and nr-limited wakeups, over tasks that
+ * sleep on a per-thread condition variable. There are no signals, and
+ * hrtimers never fire: a userspace poller polls again instead.
+ */
+
+#ifndef RINGBUF_SHIM_H
+#define RINGBUF_SHIM_H
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include "../kernel/common.h"
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+typedef int64_t s64;
+typedef s64 ktime_t;
+
+#define __percpu
+#define __user
+
+#define ERESTARTSYS 512
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#ifndef U32_MAX
+#define U32_MAX UINT32_MAX
+#endif
+
+#define SMP_CACHE_BYTES 64
+#define ____cacheline_aligned_in_smp __attribute__((aligned(SMP_CACHE_BYTES)))
+
+/* memory ordering */
+#define READ_ONCE(x)          __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)      __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p)   __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define smp_mb()              __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define cmpxchg(p, old, new)  __sync_val_compare_and_swap((p), (old), (new))
+
+#define min(a, b)             ((a) < (b) ? (a) : (b))
+#define min_t(t, a, b)        ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+
+static inline void div64_u64_rem(u64 a, u64 b, u64 *rem)
+{
+    *rem = a % b;
+}
+
+static inline int fls64(u64 v)
+{
+    return v ? 64 - __builtin_clzll(v) : 0;
+}
+
+static inline bool is_power_of_2(unsigned long n)
+{
+    return n && !(n & (n - 1));
+}
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+    return n <= 1 ? 1 : 1UL << fls64(n - 1);
+}
+
+/* time: ktime_t is CLOCK_MONOTONIC nanoseconds */
+#define NSEC_PER_SEC 1000000000LL
+#define KTIME_MAX    INT64_MAX
+
+static inline u64 ktime_get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+#define ktime_get()          ((ktime_t)ktime_get_ns())
+#define ns_to_ktime(ns)      ((ktime_t)(ns))
+#define ktime_before(a, b)   ((a) < (b))
+
+static inline ktime_t ktime_add_safe(ktime_t a, ktime_t b)
+{
+    return a > KTIME_MAX - b ? KTIME_MAX : a + b;
+}
+
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+
+#define HRTIMER_MODE_ABS 0
+
+/* never fires, see above */
+struct hrtimer {
+    enum hrtimer_restart (*function)(struct hrtimer *);
+};
+
+#define hrtimer_init(t, clock, mode)     ((void)(t))
+#define hrtimer_start(t, at, mode)       ((void)(t), (void)(at))
+
+static inline int hrtimer_try_to_cancel(struct hrtimer *t)
+{
+    (void)t;
+    return 0;
+}
+
+#define hrtimer_cancel(t) hrtimer_try_to_cancel(t)
+
+#define pr_info(...) ((void)0)
+
+/* allocation */
+#define GFP_KERNEL 0
+
+static inline void *kvmalloc_array(size_t n, size_t size, int gfp)
+{
+    (void)gfp;
+    if (size && n > SIZE_MAX / size)
+        return NULL;
+    return malloc(n * size);
+}
+
+#define kvfree(p) free(p)
+
+/* struct page only marks mirrored rings here, see rb_lib_alloc() */
+struct page;
+
+/* locking */
+struct mutex {
+    pthread_mutex_t m;
+};
+
+#define mutex_lock(l)   pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l) pthread_mutex_unlock(&(l)->m)
+
+typedef pthread_mutex_t spinlock_t;
+
+#define spin_lock_init(l) pthread_mutex_init((l), NULL)
+#define spin_lock(l)      pthread_mutex_lock(l)
+#define spin_unlock(l)    pthread_mutex_unlock(l)
+
+struct srcu_struct {
+    pthread_rwlock_t rw;
+};
+
+static inline int srcu_read_lock(struct srcu_struct *s)
+{
+    pthread_rwlock_rdlock(&s->rw);
+    return 0;
+}
+
+static inline void srcu_read_unlock(struct srcu_struct *s, int idx)
+{
+    (void)idx;
+    pthread_rwlock_unlock(&s->rw);
+}
+
+static inline void synchronize_srcu(struct srcu_struct *s)
+{
+    pthread_rwlock_wrlock(&s->rw);
+    pthread_rwlock_unlock(&s->rw);
+}
+
+/*
+ * tasks: current is the calling thread. A sleeping task waits on its
+ * condition variable until a wakeup sets it TASK_RUNNING, and a wakeup
+ * that comes between set_current_state() and schedule() is not lost.
+ */
+#define TASK_RUNNING       0
+#define TASK_INTERRUPTIBLE 1
+
+struct task_struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int state;
+    u64 timer_slack_ns;
+};
+
+static __thread struct task_struct rb_shim_task = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .timer_slack_ns = 50000,
+};
+
+#define current             (&rb_shim_task)
+#define signal_pending(t)   ((void)(t), 0)
+#define might_sleep()       do { } while (0)
+
+static inline void set_current_state(int state)
+{
+    pthread_mutex_lock(&current->lock);
+    current->state = state;
+    pthread_mutex_unlock(&current->lock);
+}
+
+#define __set_current_state(state) set_current_state(state)
+
+static inline int wake_up_process(struct task_struct *t)
+{
+    int woken = 0;
+
+    pthread_mutex_lock(&t->lock);
+    if (t->state != TASK_RUNNING) {
+        t->state = TASK_RUNNING;
+        pthread_cond_signal(&t->cond);
+        woken = 1;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return woken;
+}
+
+static inline void schedule(void)
+{
+    pthread_mutex_lock(&current->lock);
+    while (current->state != TASK_RUNNING)
+        pthread_cond_wait(&current->cond, &current->lock);
+    pthread_mutex_unlock(&current->lock);
+}
+
+/* sleep until woken (-EINTR) or *expires (0), as in the kernel */
+static inline int schedule_hrtimeout_range(ktime_t *expires, u64 delta, int mode)
+{
+    struct timespec ts = { .tv_sec = *expires / NSEC_PER_SEC, .tv_nsec = *expires % NSEC_PER_SEC };
+    int ret = -EINTR;
+
+    (void)delta;
+    (void)mode;
+    pthread_mutex_lock(&current->lock);
+    while (current->state != TASK_RUNNING) {
+        if (pthread_cond_clockwait(&current->cond, &current->lock, CLOCK_MONOTONIC, &ts) ==
+            ETIMEDOUT) {
+            if (current->state != TASK_RUNNING) {
+                current->state = TASK_RUNNING;
+                ret = 0;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&current->lock);
+    return ret;
+}
+
+/* wait queues, with the kernel's exclusive and filtered wakeups */
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define INIT_LIST_HEAD(l) ((l)->next = (l)->prev = (l))
+#define list_empty(l)     ((l)->next == (l))
+
+static inline void list_add_between(struct list_head *n, struct list_head *prev,
+                                    struct list_head *next)
+{
+    n->prev = prev;
+    n->next = next;
+    prev->next = n;
+    next->prev = n;
+}
+
+static inline void list_del_init(struct list_head *l)
+{
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+    INIT_LIST_HEAD(l);
+}
+
+#define WQ_FLAG_EXCLUSIVE 0x01
+
+struct wait_queue_entry;
+typedef int (*wait_queue_func_t)(struct wait_queue_entry *entry, unsigned int mode, int sync,
+                                 void *key);
+
+struct wait_queue_entry {
+    unsigned int flags;
+    struct task_struct *private;
+    wait_queue_func_t func;
+    struct list_head entry;
+};
+
+/* lock protects the list; the wake functions run under it */
+typedef struct {
+    pthread_mutex_t lock;
+    struct list_head head;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_init(&wq->lock, NULL);
+    INIT_LIST_HEAD(&wq->head);
+}
+
+static inline void destroy_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_destroy(&wq->lock);
+}
+
+/* the kernel peeks at the list after a full barrier; taking lock orders as much */
+static inline bool wq_has_sleeper(wait_queue_head_t *wq)
+{
+    bool ret;
+
+    pthread_mutex_lock(&wq->lock);
+    ret = !list_empty(&wq->head);
+    pthread_mutex_unlock(&wq->lock);
+    return ret;
+}
+
+static inline int default_wake_function(struct wait_queue_entry *entry, unsigned int mode,
+                                        int sync, void *key)
+{
+    (void)mode;
+    (void)sync;
+    (void)key;
+    return wake_up_process(entry->private);
+}
+
+static inline int autoremove_wake_function(struct wait_queue_entry *entry, unsigned int mode,
+                                           int sync, void *key)
+{
+    int ret = default_wake_function(entry, mode, sync, key);
+
+    if (ret)
+        list_del_init(&entry->entry);
+    return ret;
+}
+
+#define init_wait_entry(e, fl)                                          \
+do {                                                                    \
+    (e)->flags = (fl);                                                  \
+    (e)->private = current;                                             \
+    (e)->func = autoremove_wake_function;                               \
+    INIT_LIST_HEAD(&(e)->entry);                                        \
+} while (0)
+
+#define init_wait(e) init_wait_entry(e, 0)
+
+static inline void prepare_to_wait_exclusive(wait_queue_head_t *wq,
+                                             struct wait_queue_entry *entry, int state)
+{
+    pthread_mutex_lock(&wq->lock);
+    entry->flags |= WQ_FLAG_EXCLUSIVE;
+    if (list_empty(&entry->entry))
+        list_add_between(&entry->entry, wq->head.prev, &wq->head);
+    set_current_state(state);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+/* no signals here, so never -ERESTARTSYS */
+static inline long prepare_to_wait_event(wait_queue_head_t *wq, struct wait_queue_entry *entry,
+                                         int state)
+{
+    pthread_mutex_lock(&wq->lock);
+    if (list_empty(&entry->entry)) {
+        if (entry->flags & WQ_FLAG_EXCLUSIVE)
+            list_add_between(&entry->entry, wq->head.prev, &wq->head);
+        else
+            list_add_between(&entry->entry, &wq->head, wq->head.next);
+    }
+    set_current_state(state);
+    pthread_mutex_unlock(&wq->lock);
+    return 0;
+}
+
+static inline void finish_wait(wait_queue_head_t *wq, struct wait_queue_entry *entry)
+{
+    __set_current_state(TASK_RUNNING);
+    pthread_mutex_lock(&wq->lock);
+    if (!list_empty(&entry->entry))
+        list_del_init(&entry->entry);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+/*
+ * wake every non-exclusive waiter and the first nr exclusive ones that
+ * accept the wake, in queue order
+ */
+static inline void __wake_up(wait_queue_head_t *wq, unsigned int mode, int nr, void *key)
+{
+    struct list_head *pos, *next;
+    struct wait_queue_entry *entry;
+    unsigned int flags;
+    int ret;
+
+    pthread_mutex_lock(&wq->lock);
+    for (pos = wq->head.next; pos != &wq->head; pos = next) {
+        next = pos->next;
+        entry = container_of(pos, struct wait_queue_entry, entry);
+        flags = entry->flags;
+        ret = entry->func(entry, mode, 0, key);
+        if (ret < 0)
+            break;
+        if (ret && flags & WQ_FLAG_EXCLUSIVE && !--nr)
+            break;
+    }
+    pthread_mutex_unlock(&wq->lock);
+}
+
+#define EPOLLIN     POLLIN
+#define EPOLLOUT    POLLOUT
+#define EPOLLRDNORM POLLRDNORM
+#define EPOLLWRNORM POLLWRNORM
+
+typedef unsigned int __poll_t;
+
+#define poll_to_key(m) ((void *)(uintptr_t)(m))
+
+#define wake_up_interruptible_poll(wq, m) __wake_up(wq, TASK_INTERRUPTIBLE, 1, poll_to_key(m))
+
+/* the kernel's, minus signals; cmd may set __ret and break */
+#define ___wait_event(wq_head, condition, state, exclusive, ret, cmd)   \
+({                                                                      \
+    struct wait_queue_entry __wq_entry;                                 \
+    long __ret = ret;                                                   \
+                                                                        \
+    init_wait_entry(&__wq_entry, (exclusive) ? WQ_FLAG_EXCLUSIVE : 0);  \
+    for (;;) {                                                          \
+        prepare_to_wait_event(&(wq_head), &__wq_entry, state);          \
+        if (condition)                                                  \
+            break;                                                      \
+        cmd;                                                            \
+    }                                                                   \
+    finish_wait(&(wq_head), &__wq_entry);                               \
+    __ret;                                                              \
+})
+
+typedef struct {
+    int counter;
+} atomic_t;
+
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+
+/* per-CPU counters: one copy, updated atomically */
+#define this_cpu_add(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+
+/* a user buffer as an iterator */
+struct iov_iter {
+    char *base;
+    size_t count;
+};
+
+static inline void iov_iter_init_buf(struct iov_iter *i, void *buf, size_t len)
+{
+    i->base = buf;
+    i->count = len;
+}
+
+static inline size_t iov_iter_count(const struct iov_iter *i)
+{
+    return i->count;
+}
+
+static inline size_t copy_from_iter(void *to, size_t n, struct iov_iter *i)
+{
+    n = min(n, i->count);
+    memcpy(to, i->base, n);
+    i->base += n;
+    i->count -= n;
+    return n;
+}
+
+static inline size_t copy_to_iter(const void *from, size_t n, struct iov_iter *i)
+{
+    n = min(n, i->count);
+    memcpy(i->base, from, n);
+    i->base += n;
+    i->count -= n;
+    return n;
+}
+
+static inline void iov_iter_revert(struct iov_iter *i, size_t n)
+{
+    i->base -= n;
+    i->count += n;
+}
+
+/* user memory never faults here */
+#define pagefault_disable() do { } while (0)
+#define pagefault_enable()  do { } while (0)
+#define user_backed_iter(i)                 ((void)(i), true)
+#define fault_in_iov_iter_readable(i, n)    ((void)(i), (void)(n), (size_t)0)
+#define fault_in_iov_iter_writeable(i, n)   ((void)(i), (void)(n), (size_t)0)
+
+/* no tracepoints in userspace */
+#define trace_ringbuf_push(id, len, before, after) do { } while (0)
+#define trace_ringbuf_pop(id, len, before, after)  do { } while (0)
+#define trace_ringbuf_wake(id, writer, count)      do { } while (0)
+#define trace_ringbuf_block(id, writer, count)     do { (void)(writer); } while (0)
+#define trace_ringbuf_unblock(id, writer, ret, ns) do { (void)(writer); } while (0)
+
+#endif /* RINGBUF_SHIM_H */